@@ -0,0 +1,170 @@
+#include "bankdelta.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <unordered_map>
+
+namespace
+{
+	// patch: "BANK", log2 of the bank size, output size (8 bytes), the input bank of each output bank (4 bytes, noBank
+	// for none), then the bytes of the output minus the bytes of the input banks (0 for none or past the input end)
+	constexpr char magic[] = { 'B', 'A', 'N', 'K' };
+	constexpr size_t headerSize = sizeof(magic) + 1 + 8;
+	constexpr uint32_t noBank = 0xffffffff;
+
+	// windows hashed at the same offsets of every bank to find the input banks an output bank may come from
+	constexpr size_t sampleSize = 64;
+	constexpr size_t sampleStep = 1024;
+
+	// input banks found by their samples that are compared with an output bank, besides the input bank of the same
+	// index and the one after the input bank of the previous output bank
+	constexpr size_t maxCandidates = 4;
+
+	// an output bank that has fewer equal bytes than 1 / minEqualShare of its size with every candidate has no input
+	// bank
+	constexpr size_t minEqualShare = 4;
+
+	// integers of the patch are little endian
+	void appendUint(std::vector<char>& bytes, uint64_t value, size_t size)
+	{
+		for (size_t i = 0; i < size; i++)
+			bytes.push_back((char)((value >> (i * 8)) & 0xff));
+	}
+
+	uint64_t readUint(const char* data, size_t size)
+	{
+		uint64_t value = 0;
+		for (size_t i = 0; i < size; i++)
+			value |= (uint64_t)(uint8_t)data[i] << (i * 8);
+		return value;
+	}
+
+	uint64_t sampleHash(const char* data, size_t offset)
+	{
+		return std::hash<std::string_view>()(std::string_view(data, sampleSize)) ^ (offset * 0x9e3779b97f4a7c15ull);
+	}
+
+	// byte of an input bank, 0 for none or past the input end
+	char inputByte(const char* input, size_t inputSize, uint32_t bank, size_t bankSize, size_t offset)
+	{
+		if (bank == noBank)
+			return 0;
+		auto pos = (size_t)bank * bankSize + offset;
+		return pos < inputSize ? input[pos] : 0;
+	}
+}
+
+bool BankDelta::createPatch(
+	const char* input, size_t inputSize, const char* output, size_t outputSize, std::vector<char>& bytes) const
+{
+	auto inputBanks = (inputSize + bankSize - 1) / bankSize;
+	auto outputBanks = (outputSize + bankSize - 1) / bankSize;
+	if (!inputBanks || !outputBanks || inputBanks >= noBank)
+		return false;
+
+	// input banks by the hashes of their samples
+	std::unordered_map<uint64_t, std::vector<uint32_t>> index;
+	for (size_t bank = 0; bank < inputBanks; bank++)
+	{
+		auto pos = bank * bankSize;
+		for (size_t offset = 0; offset + sampleSize <= bankSize && pos + offset + sampleSize <= inputSize;
+			 offset += sampleStep)
+		{
+			auto& banks = index[sampleHash(input + pos + offset, offset)];
+			if (banks.size() < maxCandidates)
+				banks.push_back((uint32_t)bank);
+		}
+	}
+
+	std::vector<uint32_t> sources(outputBanks, noBank);
+	size_t matchedBanks = 0;
+	for (size_t bank = 0; bank < outputBanks; bank++)
+	{
+		auto pos = bank * bankSize;
+		auto size = std::min(bankSize, outputSize - pos);
+
+		// the input banks sharing the most samples are the candidates
+		std::unordered_map<uint32_t, size_t> hits;
+		for (size_t offset = 0; offset + sampleSize <= size; offset += sampleStep)
+		{
+			auto indexIt = index.find(sampleHash(output + pos + offset, offset));
+			if (indexIt == index.end())
+				continue;
+			for (auto inputBank : indexIt->second)
+				hits[inputBank]++;
+		}
+		std::vector<std::pair<size_t, uint32_t>> candidates;
+		for (const auto& hit : hits)
+			candidates.emplace_back(hit.second, hit.first);
+		auto candidatesEnd = candidates.begin() + std::min(candidates.size(), maxCandidates);
+		std::partial_sort(candidates.begin(), candidatesEnd, candidates.end(), [](const auto& a, const auto& b) {
+			return a.first != b.first ? a.first > b.first : a.second < b.second;
+		});
+		candidates.erase(candidatesEnd, candidates.end());
+		candidates.emplace_back(0, (uint32_t)bank);
+		if (bank > 0 && sources[bank - 1] != noBank)
+			candidates.emplace_back(0, sources[bank - 1] + 1);
+
+		size_t bestEqual = size / minEqualShare;
+		for (const auto& candidate : candidates)
+		{
+			if (candidate.second >= inputBanks)
+				continue;
+			size_t equal = 0;
+			for (size_t i = 0; i < size; i++)
+				equal += output[pos + i] == inputByte(input, inputSize, candidate.second, bankSize, i);
+			if (equal > bestEqual)
+			{
+				bestEqual = equal;
+				sources[bank] = candidate.second;
+			}
+		}
+		if (sources[bank] != noBank)
+			matchedBanks++;
+	}
+	if (!matchedBanks)
+		return false;
+
+	bytes.clear();
+	bytes.reserve(headerSize + outputBanks * 4 + outputSize);
+	bytes.insert(bytes.end(), magic, magic + sizeof(magic));
+	bytes.push_back((char)bankShift);
+	appendUint(bytes, outputSize, 8);
+	for (auto source : sources)
+		appendUint(bytes, source, 4);
+	for (size_t pos = 0; pos < outputSize; pos++)
+	{
+		auto inputValue = inputByte(input, inputSize, sources[pos / bankSize], bankSize, pos % bankSize);
+		bytes.push_back((char)(output[pos] - inputValue));
+	}
+	return true;
+}
+
+std::vector<char> BankDelta::applyPatch(
+	const char* input, size_t inputSize, const char* patch, size_t patchSize, size_t outputSize) const
+{
+	if (patchSize < headerSize || memcmp(patch, magic, sizeof(magic)) != 0 || (uint8_t)patch[4] >= 32 ||
+		readUint(patch + 5, 8) != outputSize)
+		return {};
+	size_t patchBankSize = (size_t)1 << (uint8_t)patch[4];
+	auto inputBanks = (inputSize + patchBankSize - 1) / patchBankSize;
+	auto outputBanks = (outputSize + patchBankSize - 1) / patchBankSize;
+	if (patchSize != headerSize + outputBanks * 4 + outputSize)
+		return {};
+
+	auto sources = patch + headerSize;
+	auto differences = sources + outputBanks * 4;
+	std::vector<char> bytes(outputSize);
+	for (size_t bank = 0; bank < outputBanks; bank++)
+	{
+		auto source = (uint32_t)readUint(sources + bank * 4, 4);
+		if (source != noBank && source >= inputBanks)
+			return {};
+		auto pos = bank * patchBankSize;
+		auto size = std::min(patchBankSize, outputSize - pos);
+		for (size_t i = 0; i < size; i++)
+			bytes[pos + i] = (char)(differences[pos + i] + inputByte(input, inputSize, source, patchBankSize, i));
+	}
+	return bytes;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "delta.h"
+
+// patches of ROMs whose banks were moved, which VCDIFF encodes poorly. the output is cut in banks of a fixed size,
+// each patched from the input bank with the most equal bytes, wherever it is, as the differences of their bytes.
+// the differences are mostly zeros, so the patch is only small once compressed. bytes inserted inside a bank shift
+// the rest of it and are left to VCDIFF
+class BankDelta : public DeltaEngine
+{
+public:
+	// log2 of the bank size of the patches created. most mappers switch 8, 16 or 32 KB banks, and a moved 32 KB bank
+	// is two moved 16 KB banks
+	static constexpr int bankShift = 14;
+	static constexpr size_t bankSize = (size_t)1 << bankShift;
+
+	const char* id() const override { return "bank"; }
+
+	bool createPatch(const char* input, size_t inputSize, const char* output, size_t outputSize,
+		std::vector<char>& bytes) const override;
+
+	std::vector<char> applyPatch(
+		const char* input, size_t inputSize, const char* patch, size_t patchSize, size_t outputSize) const override;
+};
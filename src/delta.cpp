@@ -0,0 +1,44 @@
+#include "delta.h"
+#include "bankdelta.h"
+#include "file.h"
+
+namespace
+{
+	// xdelta3 VCDIFF patches
+	class VcdiffDelta : public DeltaEngine
+	{
+	public:
+		const char* id() const override { return "vcdiff"; }
+
+		bool createPatch(const char* input, size_t inputSize, const char* output, size_t outputSize,
+			std::vector<char>& bytes) const override
+		{
+			file::PatchGroupEncoder encoder(std::vector<char>(input, input + inputSize));
+			return encoder.createPatch(output, outputSize, bytes);
+		}
+
+		std::vector<char> applyPatch(
+			const char* input, size_t inputSize, const char* patch, size_t patchSize, size_t outputSize) const override
+		{
+			return file::applyPatch(input, inputSize, patch, patchSize, outputSize);
+		}
+	};
+}
+
+const std::vector<const DeltaEngine*>& DeltaEngine::getEngines()
+{
+	static const VcdiffDelta vcdiff;
+	static const BankDelta bank;
+	static const std::vector<const DeltaEngine*> engines{ &vcdiff, &bank };
+	return engines;
+}
+
+const DeltaEngine* DeltaEngine::getEngine(const std::string_view id)
+{
+	for (auto engine : getEngines())
+	{
+		if (id == engine->id())
+			return engine;
+	}
+	return nullptr;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+// creates and applies the patches of a file against its parent. the id of the engine of a patch is recorded in
+// front of its compression, except for vcdiff
+class DeltaEngine
+{
+private:
+	DeltaEngine(const DeltaEngine& rhs) = delete;
+	DeltaEngine& operator=(const DeltaEngine& rhs) = delete;
+
+public:
+	// every engine, vcdiff first. engines are shared and can be used by many threads
+	static const std::vector<const DeltaEngine*>& getEngines();
+
+	// engine of an id (vcdiff or bank), nullptr if unknown
+	static const DeltaEngine* getEngine(const std::string_view id);
+
+	DeltaEngine() = default;
+	virtual ~DeltaEngine() = default;
+
+	virtual const char* id() const = 0;
+
+	// create a patch. output -> input + returned patch
+	// returns true + patch bytes or false
+	virtual bool createPatch(
+		const char* input, size_t inputSize, const char* output, size_t outputSize, std::vector<char>& bytes) const = 0;
+
+	// apply a patch. input + patch = output, empty if the patch is invalid
+	virtual std::vector<char> applyPatch(
+		const char* input, size_t inputSize, const char* patch, size_t patchSize, size_t outputSize) const = 0;
+};
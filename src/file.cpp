@@ -1,12 +1,23 @@
 #include "file.h"
+#include <algorithm>
+#include <array>
 #include <crc_32.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <list>
 #include <lzma.h>
+#include <map>
+#include <mutex>
+#include <set>
 #include <sha1.h>
 #include <sha2_256.h>
 #include <sha2_512.h>
+#include <stdexcept>
 #include "utils.h"
 #include <xdelta3.h>
+#include "xdelta3merge.h"
 #include <zlib.h>
 
 std::string file::hash::compute(const std::vector<char>& bytes, const std::string_view hashingAlgorithm)
@@ -114,64 +125,745 @@ void file::writeText(const std::string& filePath, const std::string& str)
 	fileStream << str;
 }
 
-bool file::createPatch(const std::string& inputFile, const std::string& outputFile, std::vector<char>& bytes)
+bool file::writeReader(const std::string& filePath, Reader& reader)
 {
-	std::vector<char> inputBytes = file::readBytes(inputFile);
-	std::vector<char> outputBytes = file::readBytes(outputFile);
+	std::ofstream fileStream(filePath.c_str(), std::ios::binary);
+	std::vector<char> buffer(1 << 20);
+	while (auto size = reader.read(buffer.data(), buffer.size()))
+		fileStream.write(buffer.data(), size);
+	return (bool)fileStream;
+}
 
-	std::vector<char> diffBytes(xd3_max(inputBytes.size(), outputBytes.size()) * 4);
-	usize_t diffSize = 0;
+size_t file::MemoryReader::read(char* data, size_t size)
+{
+	if (!bytes)
+		return 0;
+	size = std::min(size, bytes->size() - offset);
+	if (size)
+		std::memcpy(data, bytes->data() + offset, size);
+	offset += size;
+	return size;
+}
+
+// xdelta3 builds its static code table on first use, which is not thread safe
+static void initXdelta()
+{
+	static std::once_flag onceFlag;
+	std::call_once(onceFlag, [] {
+		uint8_t input[1] = { 0 };
+		uint8_t output[64];
+		usize_t outputSize = 0;
+		xd3_encode_memory(input, sizeof(input), nullptr, 0, output, &outputSize, sizeof(output), 0);
+	});
+}
 
-	auto ret =
-		xd3_encode_memory((const uint8_t*)outputBytes.data(), outputBytes.size(), (const uint8_t*)inputBytes.data(),
-			inputBytes.size(), (uint8_t*)diffBytes.data(), &diffSize, diffBytes.size(), 0);
-	if (ret == 0)
+namespace
+{
+	// provides xdelta3 source blocks from memory or from a file.
+	// file blocks are kept in a LRU list limited to the source window size
+	class BlockSource
 	{
-		diffBytes.resize((size_t)diffSize);
-		bytes = diffBytes;
-		return true;
+	private:
+		const char* data = nullptr;
+		std::ifstream ifs;
+		size_t size = 0;
+		size_t windowSize = 0;
+		size_t blockSize = 0;
+		size_t maxBlocks = 0;
+		std::list<std::pair<xoff_t, std::vector<char>>> blocks;
+
+	public:
+		BlockSource(const char* data_, size_t size_) : data(data_), size(size_), windowSize(size_), blockSize(size_) {}
+
+		BlockSource(const std::string& filePath, size_t windowSize_) :
+			ifs(filePath.c_str(), std::ios::in | std::ios::binary | std::ios::ate)
+		{
+			if (!ifs)
+				return;
+			size = (size_t)ifs.tellg();
+
+			// use 32 blocks per window like the xdelta3 command line tool
+			windowSize = std::max(windowSize_, (size_t)XD3_ALLOCSIZE * 2);
+			blockSize = XD3_ALLOCSIZE;
+			while (blockSize * 2 <= windowSize / 32)
+				blockSize *= 2;
+			maxBlocks = windowSize / blockSize;
+		}
+
+		bool isValid() const { return size > 0 && (data || ifs); }
+
+		size_t getSize() const { return size; }
+
+		// whole source is in memory
+		bool isInMemory() const { return data != nullptr; }
+
+		bool setSource(xd3_stream& stream, xd3_source& source)
+		{
+			memset(&source, 0, sizeof(source));
+			source.blksize = (usize_t)blockSize;
+			source.max_winsize = (xoff_t)windowSize;
+			if (data)
+			{
+				source.onblk = (usize_t)size;
+				source.curblk = (const uint8_t*)data;
+				source.curblkno = 0;
+			}
+			return xd3_set_source_and_size(&stream, &source, size) == 0;
+		}
+
+		bool getBlock(xd3_source& source)
+		{
+			auto blkno = source.getblkno;
+			if (data)
+				return false;
+
+			auto it = std::find_if(blocks.begin(), blocks.end(), [&](const auto& block) { return block.first == blkno; });
+			if (it != blocks.end())
+			{
+				blocks.splice(blocks.begin(), blocks, it);
+			}
+			else
+			{
+				auto blockPos = (size_t)blkno * blockSize;
+				if (blockPos >= size)
+					return false;
+
+				std::vector<char> block;
+				if (blocks.size() >= maxBlocks)
+				{
+					block = std::move(blocks.back().second);
+					blocks.pop_back();
+				}
+				block.resize(std::min(blockSize, size - blockPos));
+				ifs.clear();
+				ifs.seekg(blockPos, std::ios::beg);
+				if (!ifs.read(block.data(), block.size()))
+					return false;
+				blocks.emplace_front(blkno, std::move(block));
+			}
+			source.curblkno = blkno;
+			source.curblk = (const uint8_t*)blocks.front().second.data();
+			source.onblk = (usize_t)blocks.front().second.size();
+			return true;
+		}
+	};
+
+	// reads a file in chunks of up to chunkSize bytes
+	class ChunkReader
+	{
+	private:
+		std::ifstream ifs;
+		std::vector<char> buffer;
+		size_t size = 0;
+		size_t pos = 0;
+
+	public:
+		ChunkReader(const std::string& filePath, size_t chunkSize) :
+			ifs(filePath.c_str(), std::ios::in | std::ios::binary | std::ios::ate)
+		{
+			if (!ifs)
+				return;
+			size = (size_t)ifs.tellg();
+			ifs.seekg(0, std::ios::beg);
+			buffer.resize(std::min(size, chunkSize));
+		}
+
+		size_t getSize() const { return size; }
+
+		bool next(const char*& data, size_t& dataSize)
+		{
+			dataSize = std::min(buffer.size(), size - pos);
+			if (dataSize == 0 || !ifs.read(buffer.data(), dataSize))
+				return false;
+			data = buffer.data();
+			pos += dataSize;
+			return true;
+		}
+	};
+
+	// decodes a VCDIFF patch. nextPatch provides the patch in chunks and onOutput receives the output in chunks
+	template <class NextPatch, class OnOutput>
+	bool decodePatch(BlockSource& blockSource, NextPatch nextPatch, OnOutput onOutput)
+	{
+		initXdelta();
+
+		xd3_stream stream;
+		xd3_config config;
+		xd3_source source;
+		memset(&stream, 0, sizeof(stream));
+		memset(&config, 0, sizeof(config));
+		if (xd3_config_stream(&stream, &config) != 0)
+		{
+			xd3_free_stream(&stream);
+			return false;
+		}
+		if (blockSource.isValid() && !blockSource.setSource(stream, source))
+		{
+			xd3_free_stream(&stream);
+			return false;
+		}
+		stream.flags |= XD3_FLUSH;
+
+		bool ret = false;
+		const char* patch = nullptr;
+		size_t patchSize = 0;
+		if (nextPatch(patch, patchSize))
+		{
+			xd3_avail_input(&stream, (const uint8_t*)patch, (usize_t)patchSize);
+			while (true)
+			{
+				auto status = xd3_decode_input(&stream);
+				if (status == XD3_OUTPUT)
+				{
+					if (!onOutput((const char*)stream.next_out, (size_t)stream.avail_out))
+						break;
+					xd3_consume_output(&stream);
+				}
+				else if (status == XD3_INPUT)
+				{
+					if (!nextPatch(patch, patchSize))
+					{
+						ret = true;
+						break;
+					}
+					xd3_avail_input(&stream, (const uint8_t*)patch, (usize_t)patchSize);
+				}
+				else if (status == XD3_GETSRCBLK)
+				{
+					if (!blockSource.getBlock(source))
+						break;
+				}
+				else if (status != XD3_GOTHEADER && status != XD3_WINSTART && status != XD3_WINFINISH)
+				{
+					break;
+				}
+			}
+		}
+		xd3_close_stream(&stream);
+		xd3_free_stream(&stream);
+		return ret;
 	}
-	else
+}
+
+bool file::parsePatchProfile(const std::string& str, PatchProfile& profile)
+{
+	static const std::map<std::string, int> matcherLevels{ { "fastest", 1 }, { "faster", 2 }, { "fast", 3 },
+		{ "default", 6 }, { "slow", 9 } };
+
+	profile = {};
+	auto settings = utils::toLower(str);
+	while (!settings.empty())
 	{
-		bytes = inputBytes;
-		return false;
+		auto [setting, nextSettings] = utils::splitStringIn2(settings, ':');
+		settings = nextSettings;
+		auto matcherIt = matcherLevels.find(setting);
+		if (matcherIt != matcherLevels.end())
+			profile.level = matcherIt->second;
+		else if (setting == "djw" || setting == "fgk" || setting == "lzma")
+			profile.secondary = setting;
+		else if (setting == "adler32")
+			profile.adler32 = true;
+		else if (utils::startsWith(setting, "window=") && std::atoll(setting.c_str() + 7) > 0)
+			profile.windowSize = (size_t)std::atoll(setting.c_str() + 7) * 1024 * 1024;
+		else if (!setting.empty())
+			return false;
+	}
+	return true;
+}
+
+struct file::PatchGroupEncoder::State
+{
+	std::vector<char> inputBytes;
+	std::unique_ptr<BlockSource> blockSource;
+	PatchProfile profile;
+};
+
+file::PatchGroupEncoder::PatchGroupEncoder(
+	const std::string& inputFile, size_t windowSize, const PatchProfile& profile) :
+	state(std::make_unique<State>())
+{
+	state->profile = profile;
+	if (profile.windowSize)
+		windowSize = profile.windowSize;
+	state->blockSource = std::make_unique<BlockSource>(inputFile, windowSize);
+	if (state->blockSource->getSize() <= windowSize)
+	{
+		// small enough to keep the whole input file in memory
+		state->inputBytes = file::readBytes(inputFile);
+		state->blockSource = std::make_unique<BlockSource>(state->inputBytes.data(), state->inputBytes.size());
 	}
 }
 
-std::vector<char> file::applyPatch(const std::string& inputFile, const std::string& patchFile)
+file::PatchGroupEncoder::PatchGroupEncoder(std::vector<char> inputBytes, const PatchProfile& profile) :
+	state(std::make_unique<State>())
+{
+	state->profile = profile;
+	state->inputBytes = std::move(inputBytes);
+	state->blockSource = std::make_unique<BlockSource>(state->inputBytes.data(), state->inputBytes.size());
+}
+
+file::PatchGroupEncoder::~PatchGroupEncoder() = default;
+
+bool file::PatchGroupEncoder::createPatch(const std::string& outputFile, std::vector<char>& bytes)
 {
-	std::vector<char> inputBytes = file::readBytes(inputFile);
-	std::vector<char> patchBytes = file::readBytes(patchFile);
-	return applyPatch(inputBytes.data(), inputBytes.size(), patchBytes.data(), patchBytes.size(), 0);
+	ChunkReader reader(outputFile, XD3_DEFAULT_WINSIZE);
+	if (createPatch(reader.getSize(), [&](const char*& data, size_t& size) { return reader.next(data, size); },
+			bytes))
+		return true;
+
+	bytes = file::readBytes(outputFile);
+	return false;
+}
+
+bool file::PatchGroupEncoder::createPatch(const char* output, size_t outputSize, std::vector<char>& bytes)
+{
+	size_t outputPos = 0;
+	return createPatch(
+		outputSize,
+		[&](const char*& data, size_t& size) {
+			size = std::min(outputSize - outputPos, (size_t)XD3_DEFAULT_WINSIZE);
+			data = output + outputPos;
+			outputPos += size;
+			return size > 0;
+		},
+		bytes);
+}
+
+bool file::PatchGroupEncoder::createPatch(
+	size_t outputSize, const std::function<bool(const char*&, size_t&)>& nextOutput, std::vector<char>& bytes)
+{
+	initXdelta();
+
+	bytes.clear();
+	if (!state->blockSource->isValid() || outputSize == 0)
+		return false;
+
+	// every patch is encoded by a new stream, so it's a whole VCDIFF file that can be decoded on its own
+	xd3_stream stream;
+	xd3_config config;
+	xd3_source source;
+	memset(&stream, 0, sizeof(stream));
+	memset(&config, 0, sizeof(config));
+	config.winsize = XD3_DEFAULT_WINSIZE;
+
+	// the level selects the string matcher like the -1 to -9 options of xdelta3, and the lzma preset
+	const auto& profile = state->profile;
+	config.smatch_cfg = XD3_SMATCH_DEFAULT;
+	config.flags = (std::clamp(profile.level, 1, 9) << XD3_COMPLEVEL_SHIFT) & XD3_COMPLEVEL_MASK;
+	if (profile.secondary == "djw")
+		config.flags |= XD3_SEC_DJW;
+	else if (profile.secondary == "fgk")
+		config.flags |= XD3_SEC_FGK;
+	else if (profile.secondary == "lzma")
+		config.flags |= XD3_SEC_LZMA;
+	if (profile.adler32)
+		config.flags |= XD3_ADLER32;
+
+	// size the small match chain for files the size of the input file
+	config.sprevsz = XD3_ALLOCSIZE;
+	while (config.sprevsz < xd3_min(state->blockSource->getSize(), (size_t)config.winsize))
+		config.sprevsz <<= 1;
+
+	if (xd3_config_stream(&stream, &config) != 0)
+	{
+		xd3_free_stream(&stream);
+		return false;
+	}
+	if (!state->blockSource->setSource(stream, source))
+	{
+		xd3_free_stream(&stream);
+		return false;
+	}
+	stream.flags |= XD3_FLUSH;
+
+	bool ret = false;
+	const char* output = nullptr;
+	size_t size = 0;
+	if (nextOutput(output, size))
+	{
+		xd3_avail_input(&stream, (const uint8_t*)output, (usize_t)size);
+		while (true)
+		{
+			auto status = xd3_encode_input(&stream);
+			if (status == XD3_OUTPUT)
+			{
+				bytes.insert(
+					bytes.end(), (const char*)stream.next_out, (const char*)stream.next_out + stream.avail_out);
+				xd3_consume_output(&stream);
+			}
+			else if (status == XD3_INPUT)
+			{
+				if (!nextOutput(output, size))
+				{
+					ret = true;
+					break;
+				}
+				xd3_avail_input(&stream, (const uint8_t*)output, (usize_t)size);
+			}
+			else if (status == XD3_GETSRCBLK)
+			{
+				if (!state->blockSource->getBlock(source))
+					break;
+			}
+			else if (status != XD3_GOTHEADER && status != XD3_WINSTART && status != XD3_WINFINISH)
+			{
+				break;
+			}
+		}
+	}
+	xd3_close_stream(&stream);
+	xd3_free_stream(&stream);
+	if (!ret)
+		bytes.clear();
+	return ret;
 }
 
 std::vector<char> file::applyPatch(
 	const char* input, size_t inputSize, const char* patch, size_t patchSize, size_t originalSize)
 {
-	std::vector<char> diffBytes(originalSize ? originalSize : inputSize + patchSize);
-	usize_t diffSize = 0;
-	int iteration = 0;
-	while (iteration <= 8)
+	std::vector<char> outputBytes;
+	outputBytes.reserve(originalSize);
+
+	BlockSource blockSource(input, inputSize);
+	bool patchRead = false;
+	if (decodePatch(
+			blockSource,
+			[&](const char*& data, size_t& size) {
+				if (patchRead)
+					return false;
+				data = patch;
+				size = patchSize;
+				patchRead = true;
+				return size > 0;
+			},
+			[&](const char* data, size_t size) {
+				outputBytes.insert(outputBytes.end(), data, data + size);
+				return true;
+			}))
+		return outputBytes;
+	return {};
+}
+
+bool file::mergePatches(
+	const char* patch1, size_t patch1Size, const char* patch2, size_t patch2Size, std::vector<char>& bytes)
+{
+	initXdelta();
+
+	bytes.clear();
+	auto output = [](void* context, const uint8_t* data, size_t size) {
+		auto outputBytes = (std::vector<char>*)context;
+		outputBytes->insert(outputBytes->end(), (const char*)data, (const char*)data + size);
+		return 0;
+	};
+	if (xd3MergePatches((const uint8_t*)patch1, patch1Size, (const uint8_t*)patch2, patch2Size, output, &bytes) == 0)
+		return true;
+	bytes.clear();
+	return false;
+}
+
+namespace
+{
+	// splitmix64 finalizer, every bit of the result depends on every bit of z
+	constexpr uint64_t mix64(uint64_t z)
 	{
-		auto ret = xd3_decode_memory((const uint8_t*)patch, patchSize, (const uint8_t*)input, inputSize,
-			(uint8_t*)diffBytes.data(), &diffSize, diffBytes.size(), 0);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
 
-		if (ret == 0)
+	// random values of the gear hash. they are generated (splitmix64) instead of drawn, so chunk boundaries are the
+	// same in every build
+	constexpr std::array<uint64_t, 256> makeGearTable()
+	{
+		std::array<uint64_t, 256> table{};
+		uint64_t state = 0;
+		for (auto& value : table)
 		{
-			diffBytes.resize((size_t)diffSize);
-			return diffBytes;
+			state += 0x9e3779b97f4a7c15ull;
+			value = mix64(state);
 		}
-		else if (ret == ENOSPC)
+		return table;
+	}
+
+	constexpr auto gearTable = makeGearTable();
+}
+
+std::vector<size_t> file::chunkSizes(const char* data, size_t size)
+{
+	// FastCDC: a harder mask before the average size and an easier one after it keep chunk sizes close to the
+	// average. the hash is shifted left, so its top bits depend on the last 64 bytes
+	constexpr size_t minSize = 8 << 10;
+	constexpr size_t averageSize = 32 << 10;
+	constexpr size_t maxSize = 128 << 10;
+	constexpr uint64_t hardMask = ~0ull << (64 - 17);
+	constexpr uint64_t easyMask = ~0ull << (64 - 13);
+
+	std::vector<size_t> sizes;
+	auto bytes = (const uint8_t*)data;
+	while (size > 0)
+	{
+		auto chunkSize = std::min(size, maxSize);
+		if (size > minSize)
 		{
-			// increase buffer size and try again
-			diffBytes.resize(diffBytes.size() * 4);
-			iteration++;
+			auto normalSize = std::min(size, averageSize);
+			uint64_t hash = 0;
+			for (size_t i = minSize; i < chunkSize; i++)
+			{
+				hash = (hash << 1) + gearTable[bytes[i]];
+				if (!(hash & (i < normalSize ? hardMask : easyMask)))
+				{
+					chunkSize = i + 1;
+					break;
+				}
+			}
+		}
+		sizes.push_back(chunkSize);
+		bytes += chunkSize;
+		size -= chunkSize;
+	}
+	return sizes;
+}
+
+std::vector<uint64_t> file::sketch::compute(const char* data, size_t size)
+{
+	// the gear hash of a position depends on the 64 bytes before it. only the windows whose hash starts with 6 zero
+	// bits are sampled, which are the same windows in every file, and their hash is mixed so its order is random
+	std::set<uint64_t> hashes;
+	uint64_t maxHash = UINT64_MAX;
+	auto bytes = (const uint8_t*)data;
+	uint64_t hash = 0;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash << 1) + gearTable[bytes[i]];
+		if ((hash >> 58) || i < 63)
 			continue;
+		auto windowHash = mix64(hash);
+		if (windowHash >= maxHash || !hashes.insert(windowHash).second)
+			continue;
+		if (hashes.size() > sketch::size)
+			hashes.erase(std::prev(hashes.end()));
+		if (hashes.size() == sketch::size)
+			maxHash = *hashes.rbegin();
+	}
+	return std::vector<uint64_t>(hashes.begin(), hashes.end());
+}
+
+double file::sketch::similarity(const std::vector<uint64_t>& sketch1, const std::vector<uint64_t>& sketch2)
+{
+	// the smallest hashes of the union of both files are a sample of it, count the ones both files have
+	size_t idx1 = 0;
+	size_t idx2 = 0;
+	size_t sampled = 0;
+	size_t common = 0;
+	while (sampled < sketch::size && (idx1 < sketch1.size() || idx2 < sketch2.size()))
+	{
+		if (idx2 == sketch2.size() || (idx1 < sketch1.size() && sketch1[idx1] < sketch2[idx2]))
+			idx1++;
+		else if (idx1 == sketch1.size() || sketch2[idx2] < sketch1[idx1])
+			idx2++;
+		else
+		{
+			common++;
+			idx1++;
+			idx2++;
 		}
-		break;
+		sampled++;
 	}
-	diffBytes.clear();
-	return diffBytes;
+	return sampled ? (double)common / sampled : 0;
+}
+
+namespace
+{
+	// N64 dumps start with these bytes, in the byte order of the dump
+	constexpr char n64Magic[] = { '\x80', '\x37', '\x12', '\x40' };
+
+	// ROM sizes are multiples of 8 KB, so a dump 512 bytes bigger has a copier header
+	constexpr size_t copierHeaderSize = 512;
+	constexpr size_t romSizeUnit = 8 << 10;
+
+	// the end of a dump is only trimmed if it's at least this big
+	constexpr size_t minTrimSize = romSizeUnit;
+
+	// sizes in the data of a transform are 8 bytes, little endian
+	constexpr size_t transformSizeBytes = 8;
+
+	// reverse the byte order of every word of bytes
+	void swapBytes(char* bytes, size_t size, size_t wordSize)
+	{
+		for (size_t pos = 0; pos + wordSize <= size; pos += wordSize)
+			std::reverse(bytes + pos, bytes + pos + wordSize);
+	}
+
+	const char* swapTransform(size_t wordSize) { return wordSize == 2 ? "swap16" : "swap32"; }
+
+	void addStep(file::Transform& transform, const char* name)
+	{
+		if (!transform.name.empty())
+			transform.name += '+';
+		transform.name += name;
+	}
+
+	void appendSize(std::vector<char>& data, uint64_t size)
+	{
+		for (size_t i = 0; i < transformSizeBytes; i++)
+			data.push_back((char)((size >> (i * 8)) & 0xff));
+	}
+
+	// read a size from the end of the data of a transform
+	bool popSize(const std::vector<char>& data, size_t& dataEnd, size_t& size)
+	{
+		if (dataEnd < transformSizeBytes)
+			return false;
+		dataEnd -= transformSizeBytes;
+		uint64_t value = 0;
+		for (size_t i = 0; i < transformSizeBytes; i++)
+			value |= (uint64_t)(uint8_t)data[dataEnd + i] << (i * 8);
+		size = (size_t)value;
+		return true;
+	}
+
+	// trims the padding (the last byte repeated) or the mirrors (the bytes before repeated every power of two
+	// bytes, for overdumps) at the end of a dump, whichever leaves the fewest bytes
+	bool trimEnd(std::vector<char>& bytes, file::Transform& transform)
+	{
+		auto size = bytes.size();
+		if (size < minTrimSize * 2)
+			return false;
+
+		auto padStart = size - 1;
+		while (padStart > 1 && bytes[padStart - 1] == bytes[size - 1])
+			padStart--;
+		size_t mirrorStart = size;
+		size_t mirrorPeriod = 0;
+		for (size_t period = romSizeUnit; period <= size / 2; period *= 2)
+		{
+			// the padding repeats itself, so it's skipped
+			auto start = std::min(size, padStart + period);
+			while (start > period && bytes[start - 1] == bytes[start - 1 - period])
+				start--;
+			if (start < mirrorStart)
+			{
+				mirrorStart = start;
+				mirrorPeriod = period;
+			}
+		}
+
+		if (padStart <= mirrorStart && size - padStart >= minTrimSize)
+		{
+			addStep(transform, "pad");
+			transform.data.push_back(bytes[size - 1]);
+			appendSize(transform.data, size);
+			bytes.resize(padStart);
+			return true;
+		}
+		if (mirrorPeriod && size - mirrorStart >= minTrimSize)
+		{
+			addStep(transform, "mirror");
+			appendSize(transform.data, mirrorPeriod);
+			appendSize(transform.data, size);
+			bytes.resize(mirrorStart);
+			return true;
+		}
+		return false;
+	}
+}
+
+bool file::normalize(std::vector<char>& bytes, Transform& transform)
+{
+	transform = {};
+	bool swapped = false;
+	for (size_t wordSize : { 2, 4 })
+	{
+		if (bytes.size() < sizeof(n64Magic) || bytes.size() % wordSize != 0)
+			continue;
+		char start[sizeof(n64Magic)];
+		memcpy(start, bytes.data(), sizeof(start));
+		swapBytes(start, sizeof(start), wordSize);
+		if (memcmp(start, n64Magic, sizeof(n64Magic)) == 0)
+		{
+			swapBytes(bytes.data(), bytes.size(), wordSize);
+			addStep(transform, swapTransform(wordSize));
+			swapped = true;
+			break;
+		}
+	}
+	if (!swapped && bytes.size() > copierHeaderSize && bytes.size() % romSizeUnit == copierHeaderSize)
+	{
+		addStep(transform, "header");
+		transform.data.assign(bytes.begin(), bytes.begin() + copierHeaderSize);
+		bytes.erase(bytes.begin(), bytes.begin() + copierHeaderSize);
+	}
+	trimEnd(bytes, transform);
+	return !transform.name.empty();
+}
+
+bool file::denormalize(std::vector<char>& bytes, const Transform& transform)
+{
+	// undo the steps in reverse order, each taking its data from the end of the data of the transform
+	std::vector<std::string_view> steps;
+	std::string_view name = transform.name;
+	while (!name.empty())
+	{
+		auto stepEnd = std::min(name.find('+'), name.size());
+		steps.push_back(name.substr(0, stepEnd));
+		name.remove_prefix(std::min(stepEnd + 1, name.size()));
+	}
+	if (steps.empty())
+		return false;
+
+	size_t dataEnd = transform.data.size();
+	for (auto it = steps.rbegin(); it != steps.rend(); ++it)
+	{
+		const auto& step = *it;
+		if (step == "swap16" || step == "swap32")
+		{
+			size_t wordSize = step == "swap16" ? 2 : 4;
+			if (bytes.size() % wordSize != 0)
+				return false;
+			swapBytes(bytes.data(), bytes.size(), wordSize);
+		}
+		else if (step == "header")
+		{
+			if (dataEnd < copierHeaderSize)
+				return false;
+			dataEnd -= copierHeaderSize;
+			auto header = transform.data.begin() + dataEnd;
+			bytes.insert(bytes.begin(), header, header + copierHeaderSize);
+		}
+		else if (step == "pad")
+		{
+			size_t size = 0;
+			if (!popSize(transform.data, dataEnd, size) || dataEnd < 1 || size < bytes.size())
+				return false;
+			dataEnd--;
+			bytes.resize(size, transform.data[dataEnd]);
+		}
+		else if (step == "mirror")
+		{
+			size_t size = 0;
+			size_t period = 0;
+			if (!popSize(transform.data, dataEnd, size) || !popSize(transform.data, dataEnd, period) || period == 0 ||
+				period > bytes.size() || size < bytes.size())
+				return false;
+
+			// the bytes from the last period of the trimmed dump repeat every period bytes, so every copy doubles
+			auto repeatStart = bytes.size() - period;
+			auto pos = bytes.size();
+			bytes.resize(size);
+			while (pos < size)
+			{
+				auto length = (pos - repeatStart) / period * period;
+				auto copySize = std::min(length, size - pos);
+				memcpy(bytes.data() + pos, bytes.data() + pos - length, copySize);
+				pos += copySize;
+			}
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return dataEnd == 0;
 }
 
 static lzma_ret lzma_compress2(uint8_t* dest, size_t* destLen, const uint8_t* source, size_t sourceLen, uint32_t level)
@@ -488,3 +1180,96 @@ bool file::uncompressXz(std::vector<char>& bytes, size_t uncompressedSize)
 	}
 	return false;
 }
+
+namespace
+{
+	// input bytes of the streaming decoders are read in chunks of this size
+	constexpr size_t uncompressChunkSize = 1 << 16;
+
+	class InflateReader : public file::Reader
+	{
+	private:
+		std::unique_ptr<file::Reader> reader;
+		std::vector<char> input;
+		z_stream stream{};
+		bool finished = false;
+
+	public:
+		InflateReader(std::unique_ptr<file::Reader> reader_) : reader(std::move(reader_)), input(uncompressChunkSize)
+		{
+			if (inflateInit(&stream) != Z_OK)
+				throw std::runtime_error("can't initialize deflate decoder");
+		}
+
+		~InflateReader() { inflateEnd(&stream); }
+
+		size_t read(char* data, size_t size) override
+		{
+			stream.next_out = (Bytef*)data;
+			stream.avail_out = (uInt)std::min(size, (size_t)(uInt)-1);
+			while (!finished && stream.avail_out)
+			{
+				if (!stream.avail_in)
+				{
+					stream.next_in = (Bytef*)input.data();
+					stream.avail_in = (uInt)reader->read(input.data(), input.size());
+				}
+				auto inputEnded = !stream.avail_in;
+				auto ret = inflate(&stream, Z_NO_FLUSH);
+				if (ret == Z_STREAM_END)
+					finished = true;
+				else if (ret != Z_OK && !(ret == Z_BUF_ERROR && !inputEnded))
+					throw std::runtime_error("invalid deflate data");
+			}
+			return (char*)stream.next_out - data;
+		}
+	};
+
+	class XzReader : public file::Reader
+	{
+	private:
+		std::unique_ptr<file::Reader> reader;
+		std::vector<char> input;
+		lzma_stream stream = LZMA_STREAM_INIT;
+		bool finished = false;
+
+	public:
+		XzReader(std::unique_ptr<file::Reader> reader_) : reader(std::move(reader_)), input(uncompressChunkSize)
+		{
+			if (lzma_stream_decoder(&stream, UINT64_MAX, 0) != LZMA_OK)
+				throw std::runtime_error("can't initialize xz decoder");
+		}
+
+		~XzReader() { lzma_end(&stream); }
+
+		size_t read(char* data, size_t size) override
+		{
+			stream.next_out = (uint8_t*)data;
+			stream.avail_out = size;
+			while (!finished && stream.avail_out)
+			{
+				if (!stream.avail_in)
+				{
+					stream.next_in = (const uint8_t*)input.data();
+					stream.avail_in = reader->read(input.data(), input.size());
+				}
+				auto inputEnded = !stream.avail_in;
+				auto ret = lzma_code(&stream, inputEnded ? LZMA_FINISH : LZMA_RUN);
+				if (ret == LZMA_STREAM_END)
+					finished = true;
+				else if (ret != LZMA_OK)
+					throw std::runtime_error("invalid xz data");
+			}
+			return (char*)stream.next_out - data;
+		}
+	};
+}
+
+std::unique_ptr<file::Reader> file::openUncompressReader(std::unique_ptr<Reader> reader, const std::string& algorithm)
+{
+	if (algorithm == "deflate")
+		return std::make_unique<InflateReader>(std::move(reader));
+	else if (algorithm == "xz")
+		return std::make_unique<XzReader>(std::move(reader));
+	return reader;
+}
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -18,6 +21,35 @@ namespace file
 		std::string sha512(const char* data, size_t size);
 	}
 
+	namespace sketch
+	{
+		// number of hashes kept in a sketch
+		constexpr size_t size = 128;
+
+		// similarity sketch of bytes: the smallest distinct hashes of its 64 byte windows (bottom-k min-hash), sorted
+		std::vector<uint64_t> compute(const char* data, size_t size);
+
+		// estimated share of 64 byte windows two sketches have in common (jaccard similarity, from 0 to 1)
+		double similarity(const std::vector<uint64_t>& sketch1, const std::vector<uint64_t>& sketch2);
+	}
+
+	// reversible change that makes different dumps of a ROM equal: the byte order of N64 dumps (swap16 for .v64 and
+	// swap32 for .n64 dumps, to the big endian order of .z64 dumps) or a 512 byte copier header (header), then the
+	// padding (pad) or the overdump mirrors (mirror) trimmed from the end. name has the steps joined by '+' and data
+	// the data of every step in order: the removed header, the fill byte and the size of a padded dump, or the period
+	// and the size of a mirrored dump (sizes are 8 bytes, little endian)
+	struct Transform
+	{
+		std::string name;
+		std::vector<char> data;
+	};
+
+	// normalize a ROM dump. returns true + normalized bytes or false + unchanged bytes if there's nothing to normalize
+	bool normalize(std::vector<char>& bytes, Transform& transform);
+
+	// restore a ROM dump from its normalized bytes. returns false if the transform is invalid
+	bool denormalize(std::vector<char>& bytes, const Transform& transform);
+
 	void sort(const std::string& filePath);
 
 	std::vector<char> readBytes(const std::string& filePath);
@@ -28,17 +60,101 @@ namespace file
 
 	void writeText(const std::string& filePath, const std::string& str);
 
-	// create a VCDIFF patch. outputFile -> inputFile + returned patch file
-	// returns true + patch bytes or false + inputFile bytes
-	bool createPatch(const std::string& inputFile, const std::string& outputFile, std::vector<char>& bytes);
+	// pull based byte stream
+	class Reader
+	{
+	public:
+		virtual ~Reader() = default;
+
+		// reads up to size bytes, returns the number of bytes read (0 at the end of the stream)
+		virtual size_t read(char* data, size_t size) = 0;
+	};
+
+	// reads bytes shared with another owner (e.g. a cache) without copying them
+	class MemoryReader : public Reader
+	{
+	private:
+		std::shared_ptr<const std::vector<char>> bytes;
+		size_t offset = 0;
+
+	public:
+		MemoryReader(std::shared_ptr<const std::vector<char>> bytes_) : bytes(std::move(bytes_)) {}
 
-	// apply a VCDIFF patch. inputFile + patchFile = outputFile
-	std::vector<char> applyPatch(const std::string& inputFile, const std::string& patchFile);
+		size_t read(char* data, size_t size) override;
+	};
+
+	// uncompress the bytes of another reader as they are read (deflate or xz, other algorithms are passed through)
+	// throws std::runtime_error if the compressed bytes are invalid
+	std::unique_ptr<Reader> openUncompressReader(std::unique_ptr<Reader> reader, const std::string& algorithm);
+
+	// write all the bytes of a reader to a file
+	bool writeReader(const std::string& filePath, Reader& reader);
+
+	// default VCDIFF source window size (XD3_DEFAULT_SRCWINSZ). input files up to this size are kept in memory,
+	// bigger input files are read in blocks and only this many bytes of them are kept in memory
+	constexpr size_t defaultPatchWindowSize = 1 << 26;
+
+	// xdelta3 encoder settings of patches
+	struct PatchProfile
+	{
+		// compression level from 1 to 9, which selects the string matcher (1 = fastest, 6 = default, 9 = slow) and
+		// the lzma preset of the secondary compression
+		int level = 6;
+		// secondary compression of the sections of a patch: djw, fgk or lzma (empty = none)
+		std::string secondary;
+		// source window size in bytes of patches of a file source (0 = window size of the encoder)
+		size_t windowSize = 0;
+		// store the adler32 of every window of the output, which the decoder verifies
+		bool adler32 = false;
+	};
+
+	// parse a patch profile: settings separated by ':' among a matcher (fastest, faster, fast, default or slow),
+	// a secondary compression (djw, fgk or lzma), window=<MB> and adler32. e.g. slow:lzma:window=128:adler32
+	// returns false if a setting is invalid
+	bool parsePatchProfile(const std::string& str, PatchProfile& profile);
+
+	// creates VCDIFF patches of many files against the same input file.
+	// an input file that fits the source window is loaded once and every patch is encoded by a new xdelta3 stream
+	class PatchGroupEncoder
+	{
+	private:
+		struct State;
+		std::unique_ptr<State> state;
+
+		PatchGroupEncoder(const PatchGroupEncoder& rhs) = delete;
+		PatchGroupEncoder& operator=(const PatchGroupEncoder& rhs) = delete;
+
+		bool createPatch(
+			size_t outputSize, const std::function<bool(const char*&, size_t&)>& nextOutput, std::vector<char>& bytes);
+
+	public:
+		PatchGroupEncoder(const std::string& inputFile, size_t windowSize = defaultPatchWindowSize,
+			const PatchProfile& profile = {});
+		PatchGroupEncoder(std::vector<char> inputBytes, const PatchProfile& profile = {});
+		~PatchGroupEncoder();
+
+		// create a VCDIFF patch. outputFile -> inputFile + returned patch file
+		// returns true + patch bytes or false + outputFile bytes
+		bool createPatch(const std::string& outputFile, std::vector<char>& bytes);
+
+		// create a VCDIFF patch. output -> inputFile + returned patch file
+		// returns true + patch bytes or false
+		bool createPatch(const char* output, size_t outputSize, std::vector<char>& bytes);
+	};
 
 	// apply a VCDIFF patch. input + patch = outputFile
 	std::vector<char> applyPatch(
 		const char* input, size_t inputSize, const char* patch, size_t patchSize, size_t originalSize);
 
+	// merge a VCDIFF patch of A to B and a VCDIFF patch of B to C into a patch of A to C, without decoding the files
+	// returns true + merged patch bytes or false
+	bool mergePatches(
+		const char* patch1, size_t patch1Size, const char* patch2, size_t patch2Size, std::vector<char>& bytes);
+
+	// sizes of the content defined chunks of bytes, cut where a gear rolling hash of the last bytes matches a mask.
+	// a run of bytes shared by two files is cut in the same chunks in both, whatever its offset
+	std::vector<size_t> chunkSizes(const char* data, size_t size);
+
 	// compress a file
 	bool compress(std::vector<char>& bytes, const std::string& algorithm);
 
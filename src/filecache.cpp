@@ -0,0 +1,80 @@
+#include "filecache.h"
+
+void FileCache::evict(size_t maxSize_)
+{
+	while (size > maxSize_ && !entries.empty())
+	{
+		size -= entries.back().second->size();
+		entriesMap.erase(entries.back().first);
+		entries.pop_back();
+	}
+}
+
+void FileCache::setMaxSize(size_t maxSize_)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	maxSize = maxSize_;
+	evict(maxSize);
+}
+
+size_t FileCache::getMaxSize() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return maxSize;
+}
+
+FileCache::Bytes FileCache::get(long long fileId)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (maxSize == 0)
+		return nullptr;
+
+	auto it = entriesMap.find(fileId);
+	if (it == entriesMap.end())
+	{
+		misses++;
+		return nullptr;
+	}
+	hits++;
+	entries.splice(entries.begin(), entries, it->second);
+	return it->second->second;
+}
+
+void FileCache::put(long long fileId, Bytes bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!bytes || bytes->size() > maxSize)
+		return;
+
+	auto it = entriesMap.find(fileId);
+	if (it != entriesMap.end())
+	{
+		size -= it->second->second->size();
+		entries.erase(it->second);
+		entriesMap.erase(it);
+	}
+	evict(maxSize - bytes->size());
+	size += bytes->size();
+	entries.emplace_front(fileId, std::move(bytes));
+	entriesMap[fileId] = entries.begin();
+}
+
+void FileCache::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.clear();
+	entriesMap.clear();
+	size = 0;
+}
+
+unsigned long long FileCache::getHits() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return hits;
+}
+
+unsigned long long FileCache::getMisses() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return misses;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// thread safe LRU cache of reconstructed files, limited by the total size of the cached files
+class FileCache
+{
+public:
+	using Bytes = std::shared_ptr<const std::vector<char>>;
+
+private:
+	using Entry = std::pair<long long, Bytes>;
+
+	mutable std::mutex mutex;
+	std::list<Entry> entries;
+	std::unordered_map<long long, std::list<Entry>::iterator> entriesMap;
+	size_t maxSize = 0;
+	size_t size = 0;
+	unsigned long long hits = 0;
+	unsigned long long misses = 0;
+
+	void evict(size_t maxSize_);
+
+public:
+	FileCache(size_t maxSize_ = 0) : maxSize(maxSize_) {}
+
+	// set the maximum total size of the cached files in bytes (0 = disabled)
+	void setMaxSize(size_t maxSize_);
+	size_t getMaxSize() const;
+
+	// get a cached file or nullptr if not cached
+	Bytes get(long long fileId);
+
+	// add a file to the cache. files bigger than the cache size are not cached
+	void put(long long fileId, Bytes bytes);
+
+	void clear();
+
+	unsigned long long getHits() const;
+	unsigned long long getMisses() const;
+};
@@ -1,4 +1,5 @@
 #include <clipp.h>
+#include "delta.h"
 #include "file.h"
 #include <iostream>
 #include "romdb.h"
@@ -13,9 +14,23 @@ int main(int argc, char* argv[])
 	std::string patchFilePath;
 	std::string configName;
 	std::string sortFile;
+	long long commitInterval = 0;
+	bool resume = false;
+	bool autoPatch = false;
+	bool normalize = false;
+	size_t jobs = 1;
+	size_t patchWindow = 0;
+	std::string patchProfile;
+	std::string deltaEngine;
+	size_t cacheSize = 64;
 	bool dump = false;
 	bool fullDump = false;
 	bool verify = false;
+	bool verifyContent = false;
+	bool optimize = false;
+	bool flatten = false;
+	size_t maxDepth = 0;
+	size_t decodeBudget = 0;
 	bool help = false;
 
 	auto cli = (clipp::option("-o", "--output") & clipp::value("romdb file", dbPath),
@@ -24,9 +39,23 @@ int main(int argc, char* argv[])
 		clipp::option("-i", "--import") & clipp::value("import system(s) files path", importPath),
 		clipp::option("-p", "--patch") & clipp::value("create patch.txt from import path", patchFilePath),
 		clipp::option("-c", "--configuration") & clipp::value("import configuration name", configName),
+		clipp::option("-j", "--jobs") & clipp::value("number of worker threads (0 = all cores)", jobs),
+		clipp::option("--patch-window") & clipp::value("VCDIFF source window size in MB", patchWindow),
+		clipp::option("--patch-profile") & clipp::value("xdelta3 encoder profile (e.g. slow:lzma)", patchProfile),
+		clipp::option("--delta-engine") & clipp::value("patch delta engine (vcdiff, bank or best)", deltaEngine),
+		clipp::option("--cache") & clipp::value("reconstructed files cache size in MB", cacheSize),
+		clipp::option("--commit-interval") & clipp::value("rows per import transaction", commitInterval),
+		clipp::option("--resume").set(resume).doc("resume an import that didn't finish"),
+		clipp::option("--auto-patch").set(autoPatch).doc("patch imported files from the most similar stored file"),
+		clipp::option("--normalize").set(normalize).doc("normalize N64 byte order, remove copier headers and padding"),
 		clipp::option("-d", "--dump").set(dump).doc("dump roms"),
 		clipp::option("-f", "--full-dump").set(fullDump).doc("dump roms and metadata"),
 		clipp::option("-v", "--verify").set(verify).doc("verify romdb integrity"),
+		clipp::option("--content").set(verifyContent).doc("verify reconstructed files too"),
+		clipp::option("--optimize").set(optimize).doc("re-encode patches to bound patch chains"),
+		clipp::option("--flatten").set(flatten).doc("merge patches of patches to bound patch chains"),
+		clipp::option("--max-depth") & clipp::value("patches decoded to read a file (0 = no limit)", maxDepth),
+		clipp::option("--decode-budget") & clipp::value("MB decoded to read a file (0 = no limit)", decodeBudget),
 		clipp::option("--sort") & clipp::value("natural sort text file", sortFile),
 		clipp::option("-h", "--help").set(help).doc("help"));
 
@@ -36,6 +65,18 @@ int main(int argc, char* argv[])
 		return 0;
 	}
 
+	file::PatchProfile profile;
+	if (!file::parsePatchProfile(patchProfile, profile))
+	{
+		std::cerr << "invalid patch profile";
+		return 1;
+	}
+	if (!deltaEngine.empty() && deltaEngine != "best" && !DeltaEngine::getEngine(deltaEngine))
+	{
+		std::cerr << "invalid delta engine";
+		return 1;
+	}
+
 	try
 	{
 		if (!sortFile.empty())
@@ -52,6 +93,14 @@ int main(int argc, char* argv[])
 					std::cerr << "invalid romdb database";
 					return 1;
 				}
+				db.setCommitInterval(commitInterval);
+				db.setResume(resume);
+				db.setJobs(jobs);
+				db.setPatchWindowSize(patchWindow * 1024 * 1024);
+				db.setAutoPatch(autoPatch);
+				db.setPatchProfile(patchProfile);
+				db.setDeltaEngine(deltaEngine);
+				db.setNormalize(normalize);
 				if (!romsPath.empty())
 					db.import(romsPath, importPath, configName);
 				else
@@ -65,15 +114,34 @@ int main(int argc, char* argv[])
 					std::cerr << "invalid romdb database";
 					return 1;
 				}
+				db.setFileCacheSize(cacheSize * 1024 * 1024);
+				db.setJobs(jobs);
 				if (dump)
 				{
 					db.dump(romsPath, fullDump);
+					const auto& cache = db.getFileCache();
+					if (cache.getMaxSize() > 0)
+					{
+						std::cout << "cache hits  : " << cache.getHits() << std::endl;
+						std::cout << "cache misses: " << cache.getMisses() << std::endl;
+					}
 					return 0;
 				}
 				if (verify)
 				{
-					db.verify();
-					return 0;
+					return db.verify(verifyContent) ? 0 : 1;
+				}
+				if (optimize)
+				{
+					db.setCommitInterval(commitInterval);
+					db.setPatchWindowSize(patchWindow * 1024 * 1024);
+					db.setPatchProfile(patchProfile);
+					return db.optimize(maxDepth, decodeBudget * 1024 * 1024) ? 0 : 1;
+				}
+				if (flatten)
+				{
+					db.setCommitInterval(commitInterval);
+					return db.flatten(maxDepth) ? 0 : 1;
 				}
 			}
 		}
@@ -85,7 +153,7 @@ int main(int argc, char* argv[])
 			}
 		}
 	}
-	catch (std::exception ex)
+	catch (const std::exception& ex)
 	{
 		std::cerr << ex.what();
 		return 1;
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace pipeline
+{
+	// number of jobs to use when 0 is requested
+	inline size_t defaultJobs()
+	{
+		auto jobs = std::thread::hardware_concurrency();
+		return jobs ? jobs : 1;
+	}
+
+	// runs process(idx) for idx in [0, count) on a pool of jobs threads and calls consume(idx, result) on the
+	// calling thread in index order. at most maxInFlight results are produced ahead of consume to bound memory.
+	template <class Process, class Consume>
+	void ordered(size_t count, size_t jobs, size_t maxInFlight, Process process, Consume consume)
+	{
+		using Result = decltype(process(size_t()));
+
+		if (jobs <= 1 || count <= 1)
+		{
+			for (size_t idx = 0; idx < count; idx++)
+			{
+				auto result = process(idx);
+				consume(idx, result);
+			}
+			return;
+		}
+
+		jobs = std::min(jobs, count);
+		maxInFlight = std::max(maxInFlight, jobs);
+
+		std::vector<std::optional<Result>> slots(maxInFlight);
+		std::mutex mutex;
+		std::condition_variable producedCv;
+		std::condition_variable consumedCv;
+		size_t nextIdx = 0;
+		size_t consumedIdx = 0;
+		bool stop = false;
+		std::exception_ptr error;
+
+		auto worker = [&]() {
+			while (true)
+			{
+				size_t idx;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					consumedCv.wait(lock, [&] { return stop || nextIdx >= count || nextIdx < consumedIdx + maxInFlight; });
+					if (stop || nextIdx >= count)
+						return;
+					idx = nextIdx++;
+				}
+				try
+				{
+					auto result = process(idx);
+					std::lock_guard<std::mutex> lock(mutex);
+					slots[idx % maxInFlight] = std::move(result);
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!error)
+						error = std::current_exception();
+					stop = true;
+					consumedCv.notify_all();
+				}
+				producedCv.notify_all();
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < jobs; i++)
+			threads.emplace_back(worker);
+
+		auto finish = [&]() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			consumedCv.notify_all();
+			for (auto& thread : threads)
+				thread.join();
+		};
+
+		try
+		{
+			for (size_t idx = 0; idx < count; idx++)
+			{
+				Result result;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					producedCv.wait(lock, [&] { return error || slots[idx % maxInFlight].has_value(); });
+					if (error)
+						break;
+					result = std::move(*slots[idx % maxInFlight]);
+					slots[idx % maxInFlight].reset();
+					consumedIdx = idx + 1;
+				}
+				consumedCv.notify_all();
+				consume(idx, result);
+			}
+		}
+		catch (...)
+		{
+			finish();
+			throw;
+		}
+		finish();
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	// runs process(idx) for idx in [0, count) on a pool of jobs threads. tasks are dealt to per thread queues in index
+	// order, so pass the most expensive tasks first. a thread works from the front of its own queue and, when it runs
+	// out, steals from the back of the fullest queue, so uneven tasks don't leave threads idle at the end.
+	template <class Process>
+	void stealing(size_t count, size_t jobs, Process process)
+	{
+		if (jobs <= 1 || count <= 1)
+		{
+			for (size_t idx = 0; idx < count; idx++)
+				process(idx);
+			return;
+		}
+
+		jobs = std::min(jobs, count);
+
+		struct Queue
+		{
+			std::mutex mutex;
+			std::deque<size_t> tasks;
+		};
+		std::vector<Queue> queues(jobs);
+		for (size_t idx = 0; idx < count; idx++)
+			queues[idx % jobs].tasks.push_back(idx);
+
+		std::atomic<bool> stop = false;
+		std::mutex errorMutex;
+		std::exception_ptr error;
+
+		auto nextTask = [&](size_t thread, size_t& idx) {
+			{
+				auto& queue = queues[thread];
+				std::lock_guard<std::mutex> lock(queue.mutex);
+				if (!queue.tasks.empty())
+				{
+					idx = queue.tasks.front();
+					queue.tasks.pop_front();
+					return true;
+				}
+			}
+			// queues only shrink, so a failed steal means every queue was empty
+			while (true)
+			{
+				Queue* victim = nullptr;
+				size_t victimSize = 0;
+				for (auto& queue : queues)
+				{
+					std::lock_guard<std::mutex> lock(queue.mutex);
+					if (queue.tasks.size() > victimSize)
+					{
+						victim = &queue;
+						victimSize = queue.tasks.size();
+					}
+				}
+				if (!victim)
+					return false;
+				std::lock_guard<std::mutex> lock(victim->mutex);
+				if (!victim->tasks.empty())
+				{
+					idx = victim->tasks.back();
+					victim->tasks.pop_back();
+					return true;
+				}
+			}
+		};
+
+		auto worker = [&](size_t thread) {
+			size_t idx;
+			while (!stop && nextTask(thread, idx))
+			{
+				try
+				{
+					process(idx);
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(errorMutex);
+					if (!error)
+						error = std::current_exception();
+					stop = true;
+				}
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < jobs; i++)
+			threads.emplace_back(worker, i);
+		for (auto& thread : threads)
+			thread.join();
+		if (error)
+			std::rethrow_exception(error);
+	}
+}
@@ -2,10 +2,20 @@
 #include <algorithm>
 #include "archive.h"
 #include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include "delta.h"
 #include <deque>
 #include "file.h"
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "pipeline.h"
 #include "schema.h"
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
 #include "utils.h"
 
 using namespace sqlite3pp;
@@ -76,20 +86,739 @@ namespace
 		return importPath / (fileName + ".txt");
 	}
 
+	// keeps prepared statements alive for the duration of an import so each sql is only compiled once
+	class StatementCache
+	{
+	private:
+		database& db;
+		std::map<std::string_view, std::unique_ptr<command>> commands;
+		std::map<std::string_view, std::unique_ptr<query>> queries;
+
+	public:
+		StatementCache(database& db_) : db(db_) {}
+
+		// sql must outlive the cache (string literals)
+		command& getCommand(const char* sql)
+		{
+			auto& cmd = commands[sql];
+			if (!cmd)
+				cmd = std::make_unique<command>(db, sql);
+			else
+				cmd->reset();
+			return *cmd;
+		}
+
+		// sql must outlive the cache (string literals)
+		query& getQuery(const char* sql)
+		{
+			auto& qry = queries[sql];
+			if (!qry)
+				qry = std::make_unique<query>(db, sql);
+			else
+				qry->reset();
+			return *qry;
+		}
+	};
+
+	// wraps an import in a transaction that is committed at the first checkpoint after every commitInterval rows
+	// (0 = only at the end)
+	class BulkTransaction
+	{
+	private:
+		database& db;
+		long long commitInterval = 0;
+		long long pendingRows = 0;
+		std::optional<transaction> tx;
+
+	public:
+		BulkTransaction(database& db_, long long commitInterval_) : db(db_), commitInterval(commitInterval_)
+		{
+			tx.emplace(db);
+		}
+
+		// count a written row
+		void step() { pendingRows++; }
+
+		// end of a unit of work (a media or a patch group), commit if the interval was reached.
+		// units are never split across transactions, so a committed unit is complete
+		void checkpoint()
+		{
+			if (commitInterval > 0 && pendingRows >= commitInterval)
+			{
+				commit();
+				tx.emplace(db);
+			}
+		}
+
+		void commit()
+		{
+			if (tx && tx->commit() != SQLITE_OK)
+				throw database_error(db);
+			tx.reset();
+			pendingRows = 0;
+		}
+	};
+
+	// sqlite3pp doesn't expose the connection handle, which is needed for incremental blob I/O
+	sqlite3* getHandle(database& db)
+	{
+		struct HandleStatement : statement
+		{
+			HandleStatement(database& db) : statement(db, "SELECT 1") {}
+			sqlite3* handle() { return sqlite3_db_handle(stmt_); }
+		};
+		return HandleStatement(db).handle();
+	}
+
+	// reads blobs of a table column by rowid without going through a query
+	class BlobReader
+	{
+	private:
+		sqlite3* handle;
+		const char* table;
+		const char* column;
+		sqlite3_blob* blob = nullptr;
+
+		BlobReader(const BlobReader& rhs) = delete;
+		BlobReader& operator=(const BlobReader& rhs) = delete;
+
+	public:
+		BlobReader(database& db, const char* table_, const char* column_) :
+			handle(getHandle(db)), table(table_), column(column_) {}
+
+		~BlobReader()
+		{
+			if (blob)
+				sqlite3_blob_close(blob);
+		}
+
+		// throws std::runtime_error with the sqlite error message if the blob can't be read
+		std::vector<char> read(long long rowId)
+		{
+			int ret;
+			if (blob)
+				ret = sqlite3_blob_reopen(blob, rowId);
+			else
+				ret = sqlite3_blob_open(handle, "main", table, column, rowId, 0, &blob);
+			if (ret == SQLITE_OK)
+			{
+				std::vector<char> bytes(sqlite3_blob_bytes(blob));
+				if (bytes.empty() || sqlite3_blob_read(blob, bytes.data(), (int)bytes.size(), 0) == SQLITE_OK)
+					return bytes;
+			}
+			std::string error = std::string("can't read ") + table + "." + column + " of row " +
+				std::to_string(rowId) + ": " + sqlite3_errmsg(handle);
+
+			// a failed reopen or read leaves the handle unusable
+			if (blob)
+				sqlite3_blob_close(blob);
+			blob = nullptr;
+			throw std::runtime_error(error);
+		}
+	};
+
+	// streams one blob of a table column by rowid. the blob handle keeps a read transaction open until destroyed
+	class BlobStream : public file::Reader
+	{
+	private:
+		sqlite3_blob* blob = nullptr;
+		long long rowId;
+		int offset = 0;
+		int size = 0;
+
+		BlobStream(const BlobStream& rhs) = delete;
+		BlobStream& operator=(const BlobStream& rhs) = delete;
+
+	public:
+		BlobStream(database& db, const char* table, const char* column, long long rowId_) : rowId(rowId_)
+		{
+			if (sqlite3_blob_open(getHandle(db), "main", table, column, rowId, 0, &blob) == SQLITE_OK)
+				size = sqlite3_blob_bytes(blob);
+		}
+
+		~BlobStream()
+		{
+			if (blob)
+				sqlite3_blob_close(blob);
+		}
+
+		size_t read(char* data, size_t size_) override
+		{
+			auto readSize = (int)std::min(size_, (size_t)(size - offset));
+			if (readSize <= 0)
+				return 0;
+			if (sqlite3_blob_read(blob, data, readSize, offset) != SQLITE_OK)
+				throw std::runtime_error("can't read blob of row " + std::to_string(rowId));
+			offset += readSize;
+			return (size_t)readSize;
+		}
+	};
+
+	// "chunk" or "chunk:<algorithm>" stores a file as a list of content defined chunks compressed with algorithm
+	bool isChunkCompression(const std::string& compression)
+	{
+		return compression == "chunk" || compression.rfind("chunk:", 0) == 0;
+	}
+
+	// compression of the blobs that aren't chunk lists (patches and chunks)
+	std::string blobCompression(const std::string& compression)
+	{
+		if (!isChunkCompression(compression))
+			return compression;
+		auto pos = compression.find(':');
+		return pos != std::string::npos ? compression.substr(pos + 1) : std::string();
+	}
+
+	// patches of a delta engine other than vcdiff have its id in front of their compression ("bank" or "bank:xz")
+	constexpr std::string_view vcdiffEngine = "vcdiff";
+
+	const DeltaEngine& patchEngine(const std::string& compression)
+	{
+		auto engine = DeltaEngine::getEngine(std::string_view(compression).substr(0, compression.find(':')));
+		return *(engine ? engine : DeltaEngine::getEngine(vcdiffEngine));
+	}
+
+	// compression of a patch blob, without its delta engine
+	std::string patchBlobCompression(const std::string& compression)
+	{
+		auto pos = compression.find(':');
+		if (!DeltaEngine::getEngine(std::string_view(compression).substr(0, pos)))
+			return compression;
+		return pos != std::string::npos ? compression.substr(pos + 1) : std::string();
+	}
+
+	// compression of a patch of an engine, compressed with compression (empty = not compressed)
+	std::string patchCompression(const std::string_view engine, const std::string& compression)
+	{
+		if (engine == vcdiffEngine)
+			return compression;
+		return std::string(engine) + (!compression.empty() ? ":" + compression : std::string());
+	}
+
+	// lists of 64 bit integers (chunk lists and sketches) are stored as little endian integers
+	void appendUint64(std::vector<char>& bytes, uint64_t value)
+	{
+		for (int i = 0; i < 8; i++)
+			bytes.push_back((char)((value >> (i * 8)) & 0xff));
+	}
+
+	std::vector<uint64_t> readUint64s(const char* data, size_t size)
+	{
+		std::vector<uint64_t> values(size / 8);
+		for (size_t idx = 0; idx < values.size(); idx++)
+		{
+			for (int i = 0; i < 8; i++)
+				values[idx] |= (uint64_t)(unsigned char)data[idx * 8 + i] << (i * 8);
+		}
+		return values;
+	}
+
+	// a chunk list is the ids of the chunks of a file
+	std::vector<long long> readChunkList(const std::vector<char>& chunkList)
+	{
+		auto values = readUint64s(chunkList.data(), chunkList.size());
+		return std::vector<long long>(values.begin(), values.end());
+	}
+
+	// reads chunks by id. the query is only prepared when a chunk is read, so databases created before the chunk
+	// table can still be read
+	class ChunkReader
+	{
+	private:
+		database& db;
+		std::unique_ptr<query> qry;
+
+	public:
+		ChunkReader(database& db_) : db(db_) {}
+
+		// append the uncompressed bytes of a chunk
+		void read(long long chunkId, std::vector<char>& bytes)
+		{
+			if (!qry)
+				qry = std::make_unique<query>(
+					db, "SELECT data, size, IFNULL(compression, '') FROM chunk WHERE id = :id");
+			else
+				qry->reset();
+			qry->bind(":id", chunkId);
+			for (const auto& row : *qry)
+			{
+				auto data = (const char*)row.get<const void*>(0);
+				std::vector<char> chunk(data, data + row.column_bytes(0));
+				auto size = (size_t)row.get<long long>(1);
+				file::uncompress(chunk, size, row.get<std::string>(2));
+				if (chunk.size() != size)
+					throw std::runtime_error("invalid chunk id " + std::to_string(chunkId));
+				bytes.insert(bytes.end(), chunk.begin(), chunk.end());
+				return;
+			}
+			throw std::runtime_error("missing chunk id " + std::to_string(chunkId));
+		}
+
+		// reconstruct a file from its chunk list
+		std::vector<char> readFile(const std::vector<char>& chunkList, size_t size)
+		{
+			std::vector<char> bytes;
+			bytes.reserve(size);
+			for (auto chunkId : readChunkList(chunkList))
+				read(chunkId, bytes);
+			return bytes;
+		}
+	};
+
+	// streams a file from its chunk list one chunk at a time
+	class ChunkStream : public file::Reader
+	{
+	private:
+		ChunkReader chunkReader;
+		std::vector<long long> chunkIds;
+		size_t chunkIdx = 0;
+		std::vector<char> chunk;
+		size_t offset = 0;
+
+	public:
+		ChunkStream(database& db, const std::vector<char>& chunkList) :
+			chunkReader(db), chunkIds(readChunkList(chunkList)) {}
+
+		size_t read(char* data, size_t size) override
+		{
+			while (offset >= chunk.size())
+			{
+				if (chunkIdx >= chunkIds.size())
+					return 0;
+				chunk.clear();
+				chunkReader.read(chunkIds[chunkIdx++], chunk);
+				offset = 0;
+			}
+			size = std::min(size, chunk.size() - offset);
+			std::copy_n(chunk.data() + offset, size, data);
+			offset += size;
+			return size;
+		}
+	};
+
+	// delete the chunks no chunk list refers to anymore and return how many were deleted
+	long long removeUnusedChunks(database& db)
+	{
+		std::unordered_set<long long> usedIds;
+		BlobReader blobReader(db, "file", "data");
+		query fileQry(db, "SELECT id FROM file WHERE compression = 'chunk' OR compression LIKE 'chunk:%'");
+		for (const auto& row : fileQry)
+		{
+			for (auto chunkId : readChunkList(blobReader.read(row.get<long long>(0))))
+				usedIds.insert(chunkId);
+		}
+		std::vector<long long> unusedIds;
+		query chunkQry(db, "SELECT id FROM chunk");
+		for (const auto& row : chunkQry)
+		{
+			if (!usedIds.count(row.get<long long>(0)))
+				unusedIds.push_back(row.get<long long>(0));
+		}
+		command cmd(db, "DELETE FROM chunk WHERE id = :id");
+		for (auto chunkId : unusedIds)
+		{
+			cmd.reset();
+			cmd.bind(":id", chunkId);
+			cmd.execute();
+		}
+		return (long long)unusedIds.size();
+	}
+
+	// restore a normalized file, throws std::runtime_error if its transform is invalid
+	void restoreFile(std::vector<char>& bytes, const file::Transform& transform, long long fileId)
+	{
+		if (!file::denormalize(bytes, transform))
+			throw std::runtime_error("invalid transform for file id " + std::to_string(fileId));
+	}
+
+	// file of a patch chain
+	struct ChainFile
+	{
+		long long id = 0;
+		std::string name;
+		bool hasData = false;
+		size_t dataSize = 0;
+		size_t size = 0;
+		std::string compression;
+	};
+
+	// reconstruct a file from its blob and the bytes of its parent (nullptr for root files)
+	std::vector<char> buildFile(BlobReader& blobReader, ChunkReader& chunkReader, const ChainFile& file,
+		const std::vector<char>* parentBytes)
+	{
+		std::vector<char> bytes;
+		if (!parentBytes || parentBytes->empty())
+		{
+			if (file.hasData)
+				bytes = blobReader.read(file.id);
+			if (isChunkCompression(file.compression))
+				bytes = chunkReader.readFile(bytes, file.size);
+			else
+				file::uncompress(bytes, file.size, file.compression);
+		}
+		else if (!file.hasData && !file.size)
+		{
+			auto archive = Archive::openArchive(parentBytes->data(), parentBytes->size());
+			if (archive)
+				bytes = archive->getFile(file.name);
+			else
+				bytes = *parentBytes;
+		}
+		else if (!file.dataSize)
+		{
+			// an empty patch is an alias of a file with the same content
+			bytes = *parentBytes;
+		}
+		else
+		{
+			auto patchBytes = blobReader.read(file.id);
+			file::uncompress(patchBytes, file.size, patchBlobCompression(file.compression));
+			const auto& engine = patchEngine(file.compression);
+			bytes = engine.applyPatch(
+				parentBytes->data(), parentBytes->size(), patchBytes.data(), patchBytes.size(), file.size);
+		}
+		return bytes;
+	}
+
+	// tag ids by name and value. the tag table is small, so it's loaded once and only new tags are written
+	class TagCache
+	{
+	private:
+		std::map<std::pair<std::string, std::string>, long long> ids;
+
+	public:
+		TagCache(database& db)
+		{
+			for (const auto& row : query(db, "SELECT id, name, value FROM tag WHERE value IS NOT NULL"))
+				ids[{ row.get<std::string>(1), row.get<std::string>(2) }] = row.get<long long>(0);
+		}
+
+		long long getId(StatementCache& stmts, database& db, const std::string& name, const std::string& value)
+		{
+			auto key = std::make_pair(name, value);
+			auto it = ids.find(key);
+			if (it != ids.end())
+				return it->second;
+
+			// the tag may have been added since the cache was loaded, in which case the insert does nothing and its id
+			// is selected. only ids that were found are cached
+			auto& cmd = stmts.getCommand("INSERT INTO tag (name, value) VALUES(:name, :value) ON CONFLICT DO NOTHING");
+			cmd.bind(":name", name, nocopy);
+			cmd.bind(":value", value, nocopy);
+			if (cmd.execute() != SQLITE_OK)
+				throw database_error(db);
+			long long tagId = 0;
+			if (db.changes() > 0)
+				tagId = db.last_insert_rowid();
+			else
+			{
+				auto& qry = stmts.getQuery("SELECT id FROM tag WHERE name = :name AND value = :value");
+				qry.bind(":name", name, nocopy);
+				qry.bind(":value", value, nocopy);
+				for (const auto& row : qry)
+				{
+					tagId = row.get<long long>(0);
+					break;
+				}
+				if (!tagId)
+					throw std::runtime_error("can't find tag " + name + " = " + value);
+			}
+			ids.emplace(std::move(key), tagId);
+			return tagId;
+		}
+	};
+
+	// link an item to its tags with one statement per link
+	void insertTagLinks(StatementCache& stmts, database& db, TagCache& tagCache, const char* sql, long long itemId,
+		const utils::stringMapNoCase<std::string>& tags)
+	{
+		for (const auto& tag : tags)
+		{
+			auto& cmd = stmts.getCommand(sql);
+			cmd.bind(":tag_id", tagCache.getId(stmts, db, tag.first, tag.second));
+			cmd.bind(":item_id", itemId);
+			cmd.execute();
+		}
+	}
+
+	// auto patch finds candidate parents by the smallest hashes of sketches, compares the best candidates and only
+	// encodes a patch if the estimated similarity is high enough
+	constexpr size_t autoPatchIndexSize = 32;
+	constexpr size_t autoPatchCandidates = 4;
+	constexpr double autoPatchMinSimilarity = 0.25;
+
+	// a patch that costs less than this fraction of the size of its file is kept without compressing the file whole
+	// to compare them, since files rarely compress that much
+	constexpr double patchCheapFraction = 1.0 / 16;
+
+	// chunk of a file split in chunks. bytes are only set (and compressed) if the chunk wasn't stored yet
+	struct ImportChunk
+	{
+		std::string hash;
+		size_t offset = 0;
+		size_t size = 0;
+		std::vector<char> bytes;
+		bool compressed = false;
+	};
+
+	// file bytes ready to be written to the database
+	struct ImportFile
+	{
+		bool exists = false;
+		std::vector<char> bytes;
+		long long size = 0;
+		bool compressed = false;
+		std::string hash;
+		long long mtime = 0;
+		std::string sourceHash;
+		bool unchanged = false;
+		bool duplicate = false;
+		long long aliasId = 0;
+		std::vector<ImportChunk> chunks;
+		std::vector<uint64_t> sketch;
+		file::Transform transform;
+		// size of the normalized bytes, for files with a transform
+		long long normalizedSize = 0;
+	};
+
+	// file row of a previous import with the manifest of its source file
+	struct ImportedFile
+	{
+		long long id = 0;
+		long long parentId = 0;
+		bool hasData = false;
+		bool hasManifest = false;
+		long long size = 0;
+		long long mtime = 0;
+		std::string hash;
+	};
+
+	// patch of an imported file, with the file compressed whole if the patch may not be cheaper
+	struct ImportPatch
+	{
+		std::vector<char> bytes;
+		bool hasPatch = false;
+		bool compressed = false;
+		std::string_view engine = vcdiffEngine;
+		long long size = 0;
+		file::Transform transform;
+		std::string hash;
+		std::vector<char> standaloneBytes;
+		bool standaloneCompressed = false;
+		std::string standaloneHash;
+	};
+
+	// patches of the files of a patch group
+	struct ImportPatchGroup
+	{
+		std::vector<ImportPatch> patches;
+		std::chrono::steady_clock::duration elapsed{};
+	};
+
+	// stored file that may be an automatic patch parent
+	struct SketchedFile
+	{
+		std::string name;
+		size_t dataSize = 0;
+		std::vector<uint64_t> sketch;
+	};
+
+	// imported file patched from the most similar stored file
+	struct AutoPatch
+	{
+		long long fileId = 0;
+		long long parentId = 0;
+		double similarity = 0;
+	};
+
+	// reads the size and modification time of a source file and, unless they match its manifest, its bytes and
+	// sha1. the file is unchanged if the manifest shows it was imported with the same content
+	void readImportSource(const fs::path& filePath, const ImportedFile* imported, ImportFile& importFile)
+	{
+		importFile.size = (long long)fs::file_size(filePath);
+		importFile.mtime = (long long)fs::last_write_time(filePath).time_since_epoch().count();
+		bool hasManifest = imported && imported->hasManifest;
+		if (hasManifest && imported->size == importFile.size && imported->mtime == importFile.mtime)
+		{
+			importFile.unchanged = true;
+			return;
+		}
+		importFile.bytes = file::readBytes(filePath.string());
+		importFile.sourceHash = file::hash::sha1(importFile.bytes.data(), importFile.bytes.size());
+		if (hasManifest && imported->hash == importFile.sourceHash)
+		{
+			importFile.unchanged = true;
+			importFile.bytes.clear();
+		}
+	}
+
 	void upsertChecksum(
-		database& db, const std::vector<char>& data, long long fileId, const std::string& hashingAlgorithm)
+		StatementCache& stmts, long long fileId, const std::string& hashingAlgorithm, const std::string& hash)
 	{
-		auto hash = file::hash::compute(data, hashingAlgorithm);
 		if (!hash.empty())
 		{
-			command cmd(db, "INSERT INTO checksum (file_id, name, data) VALUES(:file_id, :name, :data) ON "
-							"CONFLICT(file_id, name) DO UPDATE SET data = excluded.data");
+			auto& cmd = stmts.getCommand("INSERT INTO checksum (file_id, name, data) VALUES(:file_id, :name, :data) ON "
+										 "CONFLICT(file_id, name) DO UPDATE SET data = excluded.data");
 			cmd.bind(":file_id", fileId);
 			cmd.bind(":name", hashingAlgorithm, nocopy);
 			cmd.bind(":data", hash, nocopy);
 			cmd.execute();
 		}
 	}
+
+	// store the transform of a normalized file, or remove the transform of a file that isn't normalized
+	void writeTransform(StatementCache& stmts, long long fileId, const file::Transform& transform)
+	{
+		if (transform.name.empty())
+		{
+			auto& cmd = stmts.getCommand("DELETE FROM transform WHERE file_id = :file_id");
+			cmd.bind(":file_id", fileId);
+			cmd.execute();
+			return;
+		}
+		auto& cmd = stmts.getCommand("INSERT INTO transform (file_id, name, data) VALUES(:file_id, :name, :data) ON "
+									 "CONFLICT(file_id) DO UPDATE SET name = excluded.name, data = excluded.data");
+		cmd.bind(":file_id", fileId);
+		cmd.bind(":name", transform.name, nocopy);
+		if (!transform.data.empty())
+			cmd.bind(":data", transform.data.data(), transform.data.size(), nocopy);
+		else
+			cmd.bind(":data");
+		cmd.execute();
+	}
+
+	// replace the stored blob of a file (compression is empty if the blob isn't compressed, parentId is 0 for a
+	// whole file) and recompute its checksums, which are checksums of the blob
+	void replaceFileData(StatementCache& stmts, long long fileId, const std::vector<char>& bytes,
+		const std::string& compression, long long parentId)
+	{
+		auto& cmd = stmts.getCommand(
+			"UPDATE file SET data = :data, compression = :compression, parent_id = :parent_id WHERE id = :file_id");
+		cmd.bind(":data", bytes.data(), bytes.size(), nocopy);
+		if (!compression.empty())
+			cmd.bind(":compression", compression, nocopy);
+		else
+			cmd.bind(":compression");
+		if (parentId)
+			cmd.bind(":parent_id", parentId);
+		else
+			cmd.bind(":parent_id");
+		cmd.bind(":file_id", fileId);
+		cmd.execute();
+
+		std::vector<std::string> checksumNames;
+		auto& qry = stmts.getQuery("SELECT name FROM checksum WHERE file_id = :file_id");
+		qry.bind(":file_id", fileId);
+		for (const auto& row : qry)
+			checksumNames.push_back(row.get<std::string>(0));
+		for (const auto& checksumName : checksumNames)
+			upsertChecksum(stmts, fileId, checksumName, file::hash::compute(bytes, utils::toLower(checksumName)));
+	}
+
+	// the parent graph of the files of a romdb. aliases (empty patches) and the files inside an archive are read
+	// from their parent without decoding a patch, so they have the depth and decode size of their parent
+	class PatchGraph
+	{
+	public:
+		struct File
+		{
+			long long parentId = 0;
+			long long size = 0;
+			bool hasData = false;
+			long long dataSize = 0;
+			std::string compression;
+			std::vector<long long> children;
+			// patches decoded and bytes reconstructed to read the file
+			size_t depth = 0;
+			long long decodeSize = 0;
+		};
+
+		// stored size, deepest chain and biggest decode of the graph
+		struct Cost
+		{
+			long long dataSize = 0;
+			size_t maxDepth = 0;
+			long long maxDecodeSize = 0;
+		};
+
+	private:
+		std::unordered_map<long long, File> files;
+		std::vector<long long> roots;
+
+	public:
+		PatchGraph(database& db)
+		{
+			query qry(db, "SELECT id, parent_id, size, LENGTH(data), IFNULL(compression, '') FROM file");
+			for (const auto& row : qry)
+			{
+				auto& file = files[row.get<long long>(0)];
+				file.parentId = row.column_type(1) != SQLITE_NULL ? row.get<long long>(1) : 0;
+				file.size = row.get<long long>(2);
+				file.hasData = row.column_type(3) != SQLITE_NULL;
+				file.dataSize = file.hasData ? row.get<long long>(3) : 0;
+				file.compression = row.get<std::string>(4);
+			}
+			for (auto& [id, file] : files)
+			{
+				auto parentIt = files.find(file.parentId);
+				if (parentIt != files.end())
+					parentIt->second.children.push_back(id);
+				else
+					roots.push_back(id);
+			}
+			std::sort(roots.begin(), roots.end());
+		}
+
+		File& at(long long id) { return files.at(id); }
+
+		static bool isPatch(const File& file) { return file.parentId && file.dataSize > 0; }
+
+		void updateCost(File& file)
+		{
+			if (!file.parentId)
+			{
+				file.depth = 0;
+				file.decodeSize = file.size;
+				return;
+			}
+			const auto& parent = files.at(file.parentId);
+			file.depth = parent.depth + (isPatch(file) ? 1 : 0);
+			file.decodeSize = parent.decodeSize + (isPatch(file) ? file.size : 0);
+		}
+
+		// visit the graph a level at a time from the root files, with the cost of the files of a level updated
+		// before visiting it, so the parents of a level have their final cost
+		template <class VisitLevel>
+		void walkLevels(VisitLevel visitLevel)
+		{
+			std::vector<long long> level = roots;
+			while (!level.empty())
+			{
+				for (auto id : level)
+					updateCost(files.at(id));
+				visitLevel(level);
+				std::vector<long long> nextLevel;
+				for (auto id : level)
+				{
+					const auto& children = files.at(id).children;
+					nextLevel.insert(nextLevel.end(), children.begin(), children.end());
+				}
+				level = std::move(nextLevel);
+			}
+		}
+
+		Cost measure() const
+		{
+			Cost cost;
+			for (const auto& [id, file] : files)
+			{
+				cost.dataSize += file.dataSize;
+				cost.maxDepth = std::max(cost.maxDepth, file.depth);
+				cost.maxDecodeSize = std::max(cost.maxDecodeSize, file.decodeSize);
+			}
+			return cost;
+		}
+	};
 }
 
 bool Romdb::open(const std::string& dbPath)
@@ -97,8 +826,13 @@ bool Romdb::open(const std::string& dbPath)
 	if (db)
 		return false;
 	db = std::move(database());
-	if (db->connect(dbPath.c_str(), SQLITE_OPEN_READWRITE) == SQLITE_OK && isValid())
+	long long transformTables = 0;
+	if (db->connect(dbPath.c_str(), SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX) == SQLITE_OK && isValid() &&
+		getLong("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'transform'", transformTables))
+	{
+		hasTransforms = transformTables != 0;
 		return true;
+	}
 	db.reset();
 	return false;
 }
@@ -107,10 +841,20 @@ bool Romdb::openOrCreate(const std::string& dbPath, const std::string& schemaPat
 {
 	if (db)
 		return false;
-	db = std::move(database(dbPath.c_str()));
+	db = std::move(database());
+
+	// import worker threads read the database while it's written, so the connection is serialized
+	if (db->connect(dbPath.c_str(), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX) != SQLITE_OK)
+	{
+		db.reset();
+		return false;
+	}
 	createSchema(schemaPath);
-	if (isValid())
+	if (isValid() && db->execute(upgradeSchema.c_str()) == SQLITE_OK)
+	{
+		hasTransforms = true;
 		return true;
+	}
 	db.reset();
 	return false;
 }
@@ -173,6 +917,8 @@ bool Romdb::isValid()
 	return true;
 }
 
+void Romdb::setJobs(size_t jobs_) { jobs = jobs_ ? jobs_ : pipeline::defaultJobs(); }
+
 bool Romdb::import(const std::string& importPath_, const std::string& configName)
 {
 	auto romsPath = fs::path(importPath_) / "files";
@@ -184,6 +930,9 @@ bool Romdb::import(const std::string& romsPath_, const std::string& importPath_,
 	if (!db)
 		return false;
 
+	// cached files may be replaced by the import
+	fileCache.clear();
+
 	fs::path romsPath(romsPath_);
 	fs::path importPath(importPath_);
 
@@ -214,471 +963,1619 @@ bool Romdb::import(const std::string& romsPath_, const std::string& importPath_,
 	return importSystem(romsPath, importPath, configName);
 }
 
-bool Romdb::importSystem(const fs::path& romsPath, const fs::path& importPath, const std::string& configName)
+// imports a system: its media, then its files, its patch groups and its automatic patches. the state the phases
+// share is kept in members, and the phases run on worker threads only read it
+class Romdb::SystemImporter
 {
-	// import system
+private:
+	Romdb& romdb;
+	database& db;
+	fs::path romsPath;
+	fs::path importPath;
+	std::string configName;
+
+	// system.txt
 	long long systemId = 0;
-	std::string systemName;
-	std::string systemCode;
 	std::string compressionAlgorithm;
 	std::string hashingAlgorithm;
+	double patchCostWeight = 0;
+	file::PatchProfile encoderProfile;
+	std::vector<const DeltaEngine*> patchEngines;
+	bool vcdiffPatches = false;
+	bool otherPatches = false;
 	bool importArchives = false;
-	{
-		auto systemFilePath = getImportFile(importPath, "system", configName);
-		if (!fs::exists(systemFilePath) || fs::is_directory(systemFilePath))
-		{
-			return false;
-		}
-		auto systemLines = utils::splitStringInLines(file::readText(systemFilePath.string()));
-		if (systemLines.size() < 2)
-		{
-			return false;
-		}
-		if (systemLines.size() >= 3)
-		{
-			compressionAlgorithm = utils::toLower(systemLines[2]);
-			importArchives = compressionAlgorithm == "archive";
-		}
-		if (systemLines.size() >= 4)
-		{
-			hashingAlgorithm = utils::toLower(systemLines[3]);
-		}
-
-		command cmd(*db, "INSERT INTO system (name, code) VALUES(:name, :code) ON CONFLICT(code) DO NOTHING");
-		cmd.bind(":name", systemLines[1], nocopy);
-		cmd.bind(":code", systemLines[0], nocopy);
-
-		if (cmd.execute() == SQLITE_OK)
-		{
-			query qry(*db, "SELECT id, name, code FROM system WHERE code = :code");
-			qry.bind(":code", systemLines[0], nocopy);
-			for (const auto& row : qry)
-			{
-				systemId = row.get<long long>(0);
-				systemName = row.get<std::string>(1);
-				systemCode = row.get<std::string>(2);
-				break;
-			}
-		}
-	}
+	bool normalizeFiles = false;
 
-	// load media and files
 	std::vector<std::string> mediaLines;
 	std::vector<std::string> fileLines;
-	{
-		auto fileFilePath = getImportFile(importPath, "file", configName);
-		if (fs::exists(fileFilePath) && !fs::is_directory(fileFilePath))
-		{
-			fileLines = utils::splitStringInLines(file::readText(fileFilePath.string()));
+
+	// files of each media, in media order
+	using MediaFiles = std::deque<std::pair<long long, std::vector<std::string>>>;
+
+	StatementCache stmts;
+	std::optional<BulkTransaction> tx;
+	std::optional<TagCache> tagCache;
+
+	// units of work (media and patch groups) committed by an import of the system that didn't finish. they are
+	// skipped when resuming and forgotten otherwise
+	std::set<std::pair<std::string, long long>> journal;
+
+	// patch.txt: the parent of every patch file, the ids of the files to patch and the ids of the parents
+	utils::stringMapNoCase<std::string> patchLinesMap;
+	utils::stringMapNoCase<long long> patchIds;
+	utils::stringMapNoCase<long long> patchParentIds;
+
+	// files already imported in the system with their manifest, so unchanged files aren't imported again
+	std::map<std::pair<long long, std::string>, ImportedFile> importedFiles;
+	TagsMap fileTags;
+	utils::stringSetNoCase changedFiles;
+	utils::stringMapNoCase<const ImportedFile*> unchangedPatchFiles;
+	std::vector<long long> sketchedFileIds;
+	long long unchangedFileCount = 0;
+
+	// files that aren't archives, in media order
+	std::vector<std::pair<long long, std::string>> files;
+
+	// file ids by sha1 of their content, so a file with the same content as a stored file (of any system) is stored
+	// as an alias of it. workers only read the ids loaded from the database and claim the content they see first, to
+	// skip compressing files that will be aliases
+	std::unordered_map<std::string, long long> contentIds;
+	std::unordered_map<std::string, long long> storedContentIds;
+	std::unordered_map<std::string, size_t> contentClaims;
+	std::mutex contentClaimsMutex;
+	long long duplicateFileCount = 0;
+
+	// chunk ids by sha1 of their content. like files, workers only compress the chunks that aren't stored and that
+	// they see first
+	bool chunkFiles = false;
+	std::string chunkCompressionAlgorithm;
+	std::unordered_map<std::string, long long> chunkIds;
+	std::unordered_map<std::string, long long> storedChunkIds;
+	std::unordered_map<std::string, size_t> chunkClaims;
+	std::mutex chunkClaimsMutex;
+	long long newChunkCount = 0;
+	long long storedChunkCount = 0;
+	bool replacedFiles = false;
+
+	// patch groups by parent file, whether their parent is normalized and the biggest size its chain may have
+	std::string patchCompressionAlgorithm;
+	std::vector<std::pair<std::string, std::vector<std::string>>> patchGroups;
+	std::vector<char> normalizeParents;
+	std::vector<long long> maxChainSizes;
+	long long standaloneFileCount = 0;
+
+	// stored files that may be automatic patch parents and the automatic patches to encode
+	std::unordered_map<long long, SketchedFile> sketchedFiles;
+	std::vector<AutoPatch> autoPatches;
+	long long autoPatchCount = 0;
+	size_t autoPatchSavedBytes = 0;
+
+	// system.txt, file.txt and media.txt
+	bool loadSystem();
+	bool loadFileLists();
+
+	void loadJournal();
+	void addJournal(const char* kind, long long unitId);
+
+	void importMedia();
+
+	void loadPatchList();
+
+	// import the files of the system, archives or not
+	void importFiles();
+	void importArchiveFiles(MediaFiles& filesToInsert);
+	void importStandaloneFiles();
+
+	const ImportedFile* findImported(long long mediaId, const std::string& file) const;
+
+	// store a file patched from a file about to change as a whole file
+	void unpatchFile(long long fileId, const std::string& compression);
+
+	// files patched from a file about to change are patched again from its new content if they are in the patch
+	// list of this import, the others are stored whole
+	void unpatchChildren(long long parentId, const std::string& parentFile);
+
+	// remove an archive file and the files inside it
+	void removeArchive(long long fileId);
+
+	// insert a new file row or update the row of a changed file with its checksum, manifest and tags and return its
+	// id. unchanged files only get their manifest and tags updated
+	long long writeFile(long long mediaId, const std::string& file, const ImportFile& importFile, bool setCompression,
+		long long parentId, const ImportedFile* imported);
+
+	bool isDuplicate(const std::string& sourceHash, size_t idx);
+	bool isNewChunk(const std::string& chunkHash, size_t idx);
+
+	// compress and hash a file or, if files are stored in chunks, split it and compress its new chunks. the chunk
+	// list and its hash are made when the chunks are written
+	void encodeFile(ImportFile& importFile, size_t idx);
+
+	// insert the chunks of a file that aren't stored and replace its bytes with its chunk list
+	void writeChunks(ImportFile& importFile);
+
+	// read, compress and hash a file on a worker thread
+	ImportFile readFile(size_t idx);
+
+	// write a file read by readFile, in order
+	void consumeFile(size_t idx, ImportFile& importFile);
+
+	// find the parents of the patch files and group the patches to import by parent
+	void groupPatches();
+
+	// reading a patched file decodes its parent chain first. a patch is only kept if its size plus the weighted size
+	// of the files of its parent chain is smaller than the size of the file stored whole
+	long long getChainSize(long long fileId);
+	bool isPatchCheaper(size_t patchSize, size_t standaloneSize, long long parentId);
+
+	// vcdiff patches are created by an encoder that loads their parent once. the patches of the other engines are
+	// created from the bytes of the parent and kept if they're smaller
+	void createOtherPatches(const std::vector<char>& input, const std::vector<char>& output,
+		const std::string& algorithm, ImportPatch& importPatch) const;
+
+	// import patches. groups are encoded on worker threads and written in order on this thread
+	void importPatches();
+	ImportPatchGroup encodePatchGroup(size_t idx);
+	void writePatchGroup(size_t idx, ImportPatchGroup& importGroup);
+
+	// patch the files read by this import from the most similar stored file that isn't a patch, in any system.
+	// files chosen as a parent aren't patched themselves, so auto patches aren't chained
+	void importAutoPatches();
+	void findAutoPatches();
+	ImportPatch encodeAutoPatch(size_t idx);
+	void writeAutoPatch(size_t idx, ImportPatch& importPatch);
+
+public:
+	SystemImporter(Romdb& romdb_, const fs::path& romsPath_, const fs::path& importPath_,
+		const std::string& configName_) :
+		romdb(romdb_), db(*romdb_.db), romsPath(romsPath_), importPath(importPath_), configName(configName_), stmts(db)
+	{
+	}
+
+	bool import();
+};
+
+bool Romdb::SystemImporter::import()
+{
+	if (!loadSystem() || !loadFileLists())
+		return false;
+
+	tx.emplace(db, romdb.commitInterval);
+	tagCache.emplace(db);
+	loadJournal();
+	importMedia();
+	loadPatchList();
+	importFiles();
+	groupPatches();
+	importPatches();
+	if (romdb.autoPatch && !importArchives && !isChunkCompression(compressionAlgorithm) && !sketchedFileIds.empty())
+		importAutoPatches();
+
+	// the import finished, so there's nothing to resume
+	auto& cmd = stmts.getCommand("DELETE FROM journal WHERE system_id = :system_id");
+	cmd.bind(":system_id", systemId);
+	cmd.execute();
+	tx->commit();
+	return true;
+}
+
+bool Romdb::SystemImporter::loadSystem()
+{
+	auto systemFilePath = getImportFile(importPath, "system", configName);
+	if (!fs::exists(systemFilePath) || fs::is_directory(systemFilePath))
+	{
+		return false;
+	}
+	auto systemLines = utils::splitStringInLines(file::readText(systemFilePath.string()));
+	if (systemLines.size() < 2)
+	{
+		return false;
+	}
+	if (systemLines.size() >= 3)
+	{
+		compressionAlgorithm = utils::toLower(systemLines[2]);
+		importArchives = compressionAlgorithm == "archive";
+	}
+	if (systemLines.size() >= 4)
+	{
+		hashingAlgorithm = utils::toLower(systemLines[3]);
+	}
+	if (systemLines.size() >= 5)
+	{
+		patchCostWeight = std::max(0.0, std::strtod(systemLines[4].c_str(), nullptr));
+	}
+	if (!file::parsePatchProfile(!romdb.patchProfile.empty()
+									 ? romdb.patchProfile
+									 : (systemLines.size() >= 6 ? systemLines[5] : std::string()),
+			encoderProfile))
+	{
+		return false;
+	}
+	if (romdb.deltaEngine == "best")
+	{
+		patchEngines = DeltaEngine::getEngines();
+	}
+	else if (auto engine = DeltaEngine::getEngine(!romdb.deltaEngine.empty() ? romdb.deltaEngine : vcdiffEngine))
+	{
+		patchEngines.push_back(engine);
+	}
+	else
+	{
+		return false;
+	}
+	vcdiffPatches = std::find(patchEngines.begin(), patchEngines.end(), DeltaEngine::getEngine(vcdiffEngine)) !=
+		patchEngines.end();
+	otherPatches = patchEngines.size() > (vcdiffPatches ? 1 : 0);
+
+	// archives are read by their format, so they aren't normalized
+	normalizeFiles = romdb.normalize && !importArchives;
+
+	query qry(db, "SELECT id, name, code FROM system WHERE code = :code");
+	qry.bind(":code", systemLines[0], nocopy);
+	for (const auto& row : qry)
+	{
+		systemId = row.get<long long>(0);
+		break;
+	}
+	if (!systemId)
+	{
+		command cmd(db, "INSERT INTO system (name, code) VALUES(:name, :code)");
+		cmd.bind(":name", systemLines[1], nocopy);
+		cmd.bind(":code", systemLines[0], nocopy);
+		if (cmd.execute() == SQLITE_OK)
+			systemId = db.last_insert_rowid();
+	}
+	return true;
+}
+
+bool Romdb::SystemImporter::loadFileLists()
+{
+	auto fileFilePath = getImportFile(importPath, "file", configName);
+	if (fs::exists(fileFilePath) && !fs::is_directory(fileFilePath))
+	{
+		fileLines = utils::splitStringInLines(file::readText(fileFilePath.string()));
+	}
+	else
+	{
+		fileLines = getFiles(romsPath);
+	}
+	if (fileLines.empty())
+	{
+		return false;
+	}
+
+	auto mediaFilePath = getImportFile(importPath, "media", configName);
+	if (fs::exists(mediaFilePath) && !fs::is_directory(mediaFilePath))
+	{
+		mediaLines = utils::splitStringInLines(file::readText(mediaFilePath.string()));
+	}
+	else
+	{
+		for (const auto& line : fileLines)
+		{
+			auto fe = utils::splitFileExtension(line);
+			if (!fe.first.empty())
+				mediaLines.push_back(std::string(fe.first));
 		}
-		else
+		std::sort(mediaLines.begin(), mediaLines.end(), utils::compareCaseInsensitive());
+	}
+	return !mediaLines.empty();
+}
+
+void Romdb::SystemImporter::loadJournal()
+{
+	if (romdb.resume)
+	{
+		auto& qry = stmts.getQuery("SELECT kind, unit_id FROM journal WHERE system_id = :system_id");
+		qry.bind(":system_id", systemId);
+		for (const auto& row : qry)
+			journal.emplace(row.get<std::string>(0), row.get<long long>(1));
+		if (!journal.empty())
+			std::cout << "resume      : " << journal.size() << " units already imported" << std::endl;
+	}
+	else
+	{
+		auto& cmd = stmts.getCommand("DELETE FROM journal WHERE system_id = :system_id");
+		cmd.bind(":system_id", systemId);
+		cmd.execute();
+	}
+}
+
+void Romdb::SystemImporter::addJournal(const char* kind, long long unitId)
+{
+	auto& cmd = stmts.getCommand(
+		"INSERT INTO journal (system_id, kind, unit_id) VALUES(:system_id, :kind, :unit_id) ON CONFLICT DO NOTHING");
+	cmd.bind(":system_id", systemId);
+	cmd.bind(":kind", kind, nocopy);
+	cmd.bind(":unit_id", unitId);
+	cmd.execute();
+}
+
+void Romdb::SystemImporter::importMedia()
+{
+	auto mediaTags = getTags(importPath / "mediatag");
+
+	// media ids of the system by name, so only new media are inserted
+	std::unordered_map<std::string, long long> mediaIdsByName;
+	{
+		auto& qry = stmts.getQuery("SELECT id, name FROM media WHERE system_id = :system_id");
+		qry.bind(":system_id", systemId);
+		for (const auto& row : qry)
+			mediaIdsByName.emplace(row.get<std::string>(1), row.get<long long>(0));
+	}
+
+	for (const auto& media : mediaLines)
+	{
+		if (media.empty())
+			continue;
+
+		tx->checkpoint();
+		auto& mediaId = mediaIdsByName[media];
+		if (!mediaId)
+		{
+			auto& cmd = stmts.getCommand("INSERT INTO media (name, system_id) VALUES(:name, :system_id)");
+			cmd.bind(":name", media, nocopy);
+			cmd.bind(":system_id", systemId);
+			if (cmd.execute() == SQLITE_OK)
+				mediaId = db.last_insert_rowid();
+			tx->step();
+		}
+
+		auto it = mediaTags.find(media);
+		if (it == mediaTags.end())
+			continue;
+
+		insertTagLinks(stmts, db, *tagCache,
+			"INSERT INTO mediatag (tag_id, media_id) VALUES(:tag_id, :item_id) ON CONFLICT DO NOTHING", mediaId,
+			it->second);
+	}
+}
+
+void Romdb::SystemImporter::loadPatchList()
+{
+	auto patchFilePath = getImportFile(importPath, "patch", configName);
+	if (!fs::exists(patchFilePath) || fs::is_directory(patchFilePath))
+		return;
+
+	auto patchLines = utils::splitStringInLines(file::readText(patchFilePath.string()));
+	std::string val;
+	for (const auto& line : patchLines)
+	{
+		if (line.empty())
 		{
-			fileLines = getFiles(romsPath);
+			val.clear();
+			continue;
 		}
-		if (fileLines.empty())
+		if (val.empty())
 		{
-			return false;
+			val = line;
+			continue;
 		}
+		patchLinesMap[line] = val;
+		patchParentIds[val] = 0;
+	}
+}
 
-		auto mediaFilePath = getImportFile(importPath, "media", configName);
-		if (fs::exists(mediaFilePath) && !fs::is_directory(mediaFilePath))
+void Romdb::SystemImporter::importFiles()
+{
+	utils::stringSetNoCase fileLinesSet(fileLines.begin(), fileLines.end());
+
+	MediaFiles filesToInsert;
+
+	// group files to media, each file to the longest media name it starts with
+	std::vector<long long> mediaIds;
+	std::vector<std::string> mediaNames;
+	auto& qry =
+		stmts.getQuery("SELECT id, name FROM media WHERE system_id = :system_id ORDER BY name COLLATE NOCASE DESC");
+	qry.bind(":system_id", systemId);
+	for (const auto& row : qry)
+	{
+		mediaIds.push_back(row.get<long long>(0));
+		mediaNames.push_back(row.get<std::string>(1));
+	}
+	auto mediaFiles = utils::groupByPrefix(fileLinesSet, mediaNames);
+	for (size_t i = 0; i < mediaIds.size(); i++)
+		filesToInsert.push_front({ mediaIds[i], std::move(mediaFiles[i]) });
+
+	fileTags = getTags(importPath / "filetag");
+
+	{
+		auto& qry = stmts.getQuery(
+			"SELECT f.id, f.media_id, f.name, IFNULL(f.parent_id, 0), mf.file_id IS NOT NULL, IFNULL(mf.size, 0), "
+			"IFNULL(mf.mtime, 0), IFNULL(mf.hash, ''), f.data IS NOT NULL FROM file f JOIN media m ON m.id = "
+			"f.media_id LEFT JOIN manifest mf ON mf.file_id = f.id WHERE m.system_id = :system_id ORDER BY f.id");
+		qry.bind(":system_id", systemId);
+		for (const auto& row : qry)
 		{
-			mediaLines = utils::splitStringInLines(file::readText(mediaFilePath.string()));
+			ImportedFile importedFile;
+			importedFile.id = row.get<long long>(0);
+			importedFile.parentId = row.get<long long>(3);
+			importedFile.hasManifest = row.get<int>(4) != 0;
+			importedFile.size = row.get<long long>(5);
+			importedFile.mtime = row.get<long long>(6);
+			importedFile.hash = row.get<std::string>(7);
+			importedFile.hasData = row.get<int>(8) != 0;
+			importedFiles.emplace(
+				std::make_pair(row.get<long long>(1), row.get<std::string>(2)), std::move(importedFile));
 		}
-		else
+	}
+
+	if (importArchives)
+	{
+		importArchiveFiles(filesToInsert);
+	}
+	else
+	{
+		for (const auto& mediaFiles : filesToInsert)
 		{
-			for (const auto& line : fileLines)
+			for (const auto& file : mediaFiles.second)
 			{
-				auto fe = utils::splitFileExtension(line);
-				if (!fe.first.empty())
-					mediaLines.push_back(std::string(fe.first));
+				if (!file.empty())
+					files.push_back({ mediaFiles.first, file });
 			}
-			std::sort(mediaLines.begin(), mediaLines.end(), utils::compareCaseInsensitive());
 		}
-		if (mediaLines.empty())
+		importStandaloneFiles();
+	}
+	if (unchangedFileCount)
+		std::cout << "unchanged   : " << unchangedFileCount << " files" << std::endl;
+}
+
+const ImportedFile* Romdb::SystemImporter::findImported(long long mediaId, const std::string& file) const
+{
+	auto it = importedFiles.find({ mediaId, file });
+	return it != importedFiles.end() ? &it->second : nullptr;
+}
+
+void Romdb::SystemImporter::unpatchFile(long long fileId, const std::string& compression)
+{
+	auto bytes = romdb.getNormalizedFile(fileId);
+	auto compressed = file::compress(bytes, compression);
+	replaceFileData(stmts, fileId, bytes, compressed ? compression : std::string(), 0);
+}
+
+void Romdb::SystemImporter::unpatchChildren(long long parentId, const std::string& parentFile)
+{
+	struct Child
+	{
+		long long id;
+		long long mediaId;
+		std::string name;
+		std::string compression;
+	};
+	std::vector<Child> children;
+	auto& qry = stmts.getQuery("SELECT id, media_id, name, IFNULL(compression, '') FROM file WHERE parent_id = "
+							   ":parent_id AND data IS NOT NULL");
+	qry.bind(":parent_id", parentId);
+	for (const auto& row : qry)
+	{
+		children.push_back(
+			{ row.get<long long>(0), row.get<long long>(1), row.get<std::string>(2), row.get<std::string>(3) });
+	}
+	utils::compareCaseInsensitive compare;
+	for (const auto& child : children)
+	{
+		auto patchLineIt = patchLinesMap.find(child.name);
+		if (findImported(child.mediaId, child.name) && patchLineIt != patchLinesMap.end() &&
+			!compare(patchLineIt->second, parentFile) && !compare(parentFile, patchLineIt->second) &&
+			fs::exists(romsPath / child.name))
+			continue;
+		unpatchFile(child.id, patchBlobCompression(child.compression));
+	}
+	// the cache has the content the parent had before it changed
+	romdb.fileCache.clear();
+}
+
+void Romdb::SystemImporter::removeArchive(long long fileId)
+{
+	for (auto sql : { "DELETE FROM checksum WHERE file_id IN (SELECT id FROM file WHERE id = :file_id OR (parent_id = "
+					  ":file_id AND data IS NULL))",
+			 "DELETE FROM filetag WHERE file_id IN (SELECT id FROM file WHERE id = :file_id OR (parent_id = :file_id "
+			 "AND data IS NULL))",
+			 "DELETE FROM manifest WHERE file_id = :file_id",
+			 "DELETE FROM file WHERE id = :file_id OR (parent_id = :file_id AND data IS NULL)" })
+	{
+		auto& cmd = stmts.getCommand(sql);
+		cmd.bind(":file_id", fileId);
+		cmd.execute();
+	}
+}
+
+long long Romdb::SystemImporter::writeFile(long long mediaId, const std::string& file, const ImportFile& importFile,
+	bool setCompression, long long parentId, const ImportedFile* imported)
+{
+	long long fileId = imported ? imported->id : 0;
+	if (importFile.unchanged)
+	{
+		if (!fileId)
+			return fileId;
+		unchangedFileCount++;
+		if (patchLinesMap.find(file) != patchLinesMap.end())
+			unchangedPatchFiles[file] = imported;
+	}
+	else
+	{
+		if (fileId)
+			unpatchChildren(fileId, file);
+
+		auto& cmd = fileId ? stmts.getCommand("UPDATE file SET name = :name, data = :data, size = :size, compression = "
+											  ":compression, media_id = :media_id, parent_id = :parent_id WHERE id = "
+											  ":file_id")
+						   : stmts.getCommand("INSERT INTO file (name, data, size, compression, media_id, parent_id) "
+											  "VALUES(:name, :data, :size, :compression, :media_id, :parent_id)");
+		cmd.bind(":name", file, nocopy);
+		if (!importFile.bytes.empty())
+			cmd.bind(":data", importFile.bytes.data(), importFile.bytes.size(), nocopy);
+		else if (importFile.aliasId)
+			cmd.bind(":data", "", 0, nocopy);
+		else
+			cmd.bind(":data");
+		cmd.bind(":size", importFile.transform.name.empty() ? importFile.size : importFile.normalizedSize);
+		if (setCompression)
+			cmd.bind(":compression", compressionAlgorithm, nocopy);
+		else
+			cmd.bind(":compression");
+		cmd.bind(":media_id", mediaId);
+		if (parentId)
+			cmd.bind(":parent_id", parentId);
+		else
+			cmd.bind(":parent_id");
+		if (fileId)
+			cmd.bind(":file_id", fileId);
+		auto fileWriteResult = cmd.execute();
+
+		if (fileWriteResult == SQLITE_OK)
 		{
-			return false;
+			if (!fileId)
+				fileId = db.last_insert_rowid();
+
+			if (importFile.bytes.empty() && !importFile.aliasId)
+				patchIds[file] = fileId;
 		}
+		else
+			fileId = 0;
+		changedFiles.insert(file);
+
+		// upsert file hash
+		if (!importFile.hash.empty())
+			upsertChecksum(stmts, fileId, hashingAlgorithm, importFile.hash);
+		if (fileId)
+			writeTransform(stmts, fileId, importFile.transform);
+		tx->step();
+	}
+
+	auto patchParentIt = patchParentIds.find(file);
+	if (patchParentIt != patchParentIds.end())
+		patchParentIt->second = fileId;
+
+	// upsert the manifest of files that were read
+	if (fileId && !importFile.sourceHash.empty())
+	{
+		auto& cmd = stmts.getCommand(
+			"INSERT INTO manifest (file_id, path, size, mtime, hash) VALUES(:file_id, :path, :size, :mtime, :hash) ON "
+			"CONFLICT(file_id) DO UPDATE SET path = excluded.path, size = excluded.size, mtime = excluded.mtime, "
+			"hash = excluded.hash");
+		auto path = (romsPath / file).string();
+		cmd.bind(":file_id", fileId);
+		cmd.bind(":path", path, nocopy);
+		cmd.bind(":size", importFile.size);
+		cmd.bind(":mtime", importFile.mtime);
+		cmd.bind(":hash", importFile.sourceHash, nocopy);
+		cmd.execute();
 	}
 
-	// import media
+	// upsert the similarity sketch of files that were read
+	if (fileId && !importFile.sketch.empty())
 	{
-		auto mediaTags = getTags(importPath / "mediatag");
+		std::vector<char> sketchBytes;
+		for (auto hash : importFile.sketch)
+			appendUint64(sketchBytes, hash);
+		auto& cmd = stmts.getCommand(
+			"INSERT INTO sketch (file_id, data) VALUES(:file_id, :data) ON CONFLICT(file_id) DO UPDATE SET data = "
+			"excluded.data");
+		cmd.bind(":file_id", fileId);
+		cmd.bind(":data", sketchBytes.data(), sketchBytes.size(), nocopy);
+		cmd.execute();
+	}
+
+	// insert file tags
+	auto it = fileTags.find(file);
+	if (it == fileTags.end())
+		return fileId;
+
+	insertTagLinks(stmts, db, *tagCache,
+		"INSERT INTO filetag (tag_id, file_id) VALUES(:tag_id, :item_id) ON CONFLICT DO NOTHING", fileId, it->second);
+	return fileId;
+}
 
-		for (const auto& media : mediaLines)
+void Romdb::SystemImporter::importArchiveFiles(MediaFiles& filesToInsert)
+{
+	for (auto& files : filesToInsert)
+	{
+		std::unique_ptr<Archive> arch;
+		long long archiveParentId = 0;
+		auto mediaId = files.first;
+		if (journal.count({ "media", mediaId }))
+			continue;
+		for (size_t fileIdx = 0; fileIdx < files.second.size(); fileIdx++)
 		{
-			if (media.empty())
+			const auto file = files.second[fileIdx];
+			if (file.empty())
 				continue;
 
-			command cmd(*db, "INSERT INTO media (name, system_id) VALUES(:name, :system_id) ON CONFLICT DO NOTHING");
-			cmd.bind(":name", media, nocopy);
-			cmd.bind(":system_id", systemId);
+			// the first file of the media is the archive, the others are the files inside it
+			bool archiveFile = !archiveParentId;
+			auto filePath = romsPath / file;
+			if (archiveFile && (!fs::exists(filePath) || fs::is_directory(filePath)))
+				continue;
 
-			long long mediaId = 0;
-			if (cmd.execute() == SQLITE_OK)
+			ImportFile importFile;
+			const ImportedFile* imported = nullptr;
+			if (patchLinesMap.find(file) == patchLinesMap.end())
 			{
-				query qry(*db, "SELECT id FROM media WHERE name = :name AND system_id = :system_id");
-				qry.bind(":name", media, nocopy);
-				qry.bind(":system_id", systemId);
-				for (const auto& row : qry)
+				if (!arch)
 				{
-					mediaId = row.get<long long>(0);
-					break;
+					imported = findImported(mediaId, file);
+					readImportSource(filePath, imported, importFile);
+					if (importFile.unchanged)
+					{
+						// the files inside an unchanged archive are unchanged too
+						writeFile(mediaId, file, importFile, archiveFile, 0, imported);
+						break;
+					}
+					if (imported)
+					{
+						removeArchive(imported->id);
+						imported = nullptr;
+					}
+					arch = Archive::openArchive(importFile.bytes.data(), importFile.bytes.size());
+					if (!arch)
+						continue;
+					for (const auto& name : arch->getFileNames())
+						files.second.push_back(name);
 				}
 			}
+			else
+				importFile.size = fs::file_size(filePath);
 
-			auto it = mediaTags.find(media);
-			if (it == mediaTags.end())
-				continue;
+			if (archiveFile && !hashingAlgorithm.empty())
+				importFile.hash = file::hash::compute(importFile.bytes, hashingAlgorithm);
+
+			auto fileId =
+				writeFile(mediaId, file, importFile, archiveFile, archiveFile ? 0 : archiveParentId, imported);
+			if (archiveFile)
+				archiveParentId = fileId;
+		}
+		addJournal("media", mediaId);
+		tx->checkpoint();
+	}
+}
+
+bool Romdb::SystemImporter::isDuplicate(const std::string& sourceHash, size_t idx)
+{
+	if (storedContentIds.count(sourceHash))
+		return true;
+	std::lock_guard<std::mutex> lock(contentClaimsMutex);
+	auto& claim = contentClaims.emplace(sourceHash, idx).first->second;
+	claim = std::min(claim, idx);
+	return claim < idx;
+}
+
+bool Romdb::SystemImporter::isNewChunk(const std::string& chunkHash, size_t idx)
+{
+	if (storedChunkIds.count(chunkHash))
+		return false;
+	std::lock_guard<std::mutex> lock(chunkClaimsMutex);
+	auto& claim = chunkClaims.emplace(chunkHash, idx).first->second;
+	claim = std::min(claim, idx);
+	return claim == idx;
+}
 
-			for (const auto& tag : it->second)
+void Romdb::SystemImporter::encodeFile(ImportFile& importFile, size_t idx)
+{
+	if (chunkFiles && !importFile.bytes.empty())
+	{
+		size_t offset = 0;
+		for (auto chunkSize : file::chunkSizes(importFile.bytes.data(), importFile.bytes.size()))
+		{
+			ImportChunk chunk;
+			chunk.offset = offset;
+			chunk.size = chunkSize;
+			chunk.hash = file::hash::sha1(importFile.bytes.data() + offset, chunkSize);
+			if (isNewChunk(chunk.hash, idx))
 			{
-				command cmd2(*db, "INSERT INTO tag (name, value) VALUES(:name, :value) ON CONFLICT DO NOTHING");
-				cmd2.bind(":name", tag.first, nocopy);
-				if (!it->second.empty())
-					cmd2.bind(":value", tag.second, nocopy);
-				else
-					cmd2.bind(":value");
+				auto chunkStart = importFile.bytes.begin() + offset;
+				chunk.bytes.assign(chunkStart, chunkStart + chunkSize);
+				chunk.compressed = file::compress(chunk.bytes, chunkCompressionAlgorithm);
+			}
+			importFile.chunks.push_back(std::move(chunk));
+			offset += chunkSize;
+		}
+		return;
+	}
+	importFile.compressed = file::compress(importFile.bytes, compressionAlgorithm);
+	if (!hashingAlgorithm.empty())
+		importFile.hash = file::hash::compute(importFile.bytes, hashingAlgorithm);
+}
 
-				long long tagId = 0;
-				if (cmd2.execute() == SQLITE_OK)
-				{
-					query qry(*db, "SELECT id FROM tag WHERE name = :name AND value = :value");
-					qry.bind(":name", tag.first, nocopy);
-					if (!it->second.empty())
-						qry.bind(":value", tag.second, nocopy);
-					else
-						qry.bind(":value");
-					for (const auto& row : qry)
-					{
-						tagId = row.get<long long>(0);
-						break;
-					}
-				}
+void Romdb::SystemImporter::writeChunks(ImportFile& importFile)
+{
+	std::vector<char> chunkList;
+	for (auto& chunk : importFile.chunks)
+	{
+		auto it = chunkIds.find(chunk.hash);
+		if (it == chunkIds.end())
+		{
+			if (chunk.bytes.empty())
+			{
+				auto chunkStart = importFile.bytes.begin() + chunk.offset;
+				chunk.bytes.assign(chunkStart, chunkStart + chunk.size);
+				chunk.compressed = file::compress(chunk.bytes, chunkCompressionAlgorithm);
+			}
+			auto& cmd = stmts.getCommand(
+				"INSERT INTO chunk (hash, size, compression, data) VALUES(:hash, :size, :compression, :data)");
+			cmd.bind(":hash", chunk.hash, nocopy);
+			cmd.bind(":size", (long long)chunk.size);
+			if (chunk.compressed)
+				cmd.bind(":compression", chunkCompressionAlgorithm, nocopy);
+			else
+				cmd.bind(":compression");
+			cmd.bind(":data", chunk.bytes.data(), chunk.bytes.size(), nocopy);
+			if (cmd.execute() != SQLITE_OK)
+				throw database_error(db);
+			it = chunkIds.emplace(chunk.hash, db.last_insert_rowid()).first;
+			newChunkCount++;
+			tx->step();
+		}
+		else
+			storedChunkCount++;
+		appendUint64(chunkList, (uint64_t)it->second);
+	}
+	importFile.bytes = std::move(chunkList);
+	importFile.compressed = true;
+	importFile.chunks.clear();
+	if (!hashingAlgorithm.empty())
+		importFile.hash = file::hash::compute(importFile.bytes, hashingAlgorithm);
+}
+
+void Romdb::SystemImporter::importStandaloneFiles()
+{
+	{
+		auto& qry = stmts.getQuery("SELECT mf.hash, mf.file_id FROM manifest mf JOIN file f ON f.id = mf.file_id WHERE "
+								   "LENGTH(f.data) > 0 AND f.size > 0 ORDER BY mf.file_id");
+		for (const auto& row : qry)
+			contentIds.emplace(row.get<std::string>(0), row.get<long long>(1));
+	}
+	storedContentIds = contentIds;
+
+	chunkFiles = isChunkCompression(compressionAlgorithm);
+	chunkCompressionAlgorithm = blobCompression(compressionAlgorithm);
+	if (chunkFiles)
+	{
+		auto& qry = stmts.getQuery("SELECT hash, id FROM chunk");
+		for (const auto& row : qry)
+			chunkIds.emplace(row.get<std::string>(0), row.get<long long>(1));
+	}
+	storedChunkIds = chunkIds;
+
+	// read, compress and hash files on worker threads and write them in order on this thread
+	pipeline::ordered(
+		files.size(), romdb.jobs, romdb.jobs * 2, [this](size_t idx) { return readFile(idx); },
+		[this](size_t idx, ImportFile& importFile) { consumeFile(idx, importFile); });
+	if (duplicateFileCount)
+		std::cout << "duplicate   : " << duplicateFileCount << " files" << std::endl;
+
+	// chunks only used by the previous content of changed files
+	long long removedChunkCount = 0;
+	long long hasChunks = 0;
+	if (replacedFiles && romdb.getLong("SELECT EXISTS(SELECT 1 FROM chunk)", hasChunks) && hasChunks)
+		removedChunkCount = removeUnusedChunks(db);
+	if (newChunkCount || storedChunkCount || removedChunkCount)
+	{
+		std::cout << "chunks      : " << newChunkCount << " new, " << storedChunkCount << " already stored, "
+				  << removedChunkCount << " removed" << std::endl;
+	}
+}
+
+ImportFile Romdb::SystemImporter::readFile(size_t idx)
+{
+	ImportFile importFile;
+	if (journal.count({ "media", files[idx].first }))
+	{
+		importFile.exists = true;
+		importFile.unchanged = true;
+		return importFile;
+	}
+	auto filePath = romsPath / files[idx].second;
+	if (!fs::exists(filePath) || fs::is_directory(filePath))
+		return importFile;
+
+	importFile.exists = true;
+	readImportSource(filePath, findImported(files[idx].first, files[idx].second), importFile);
+	if (importFile.unchanged)
+		return importFile;
+
+	if (normalizeFiles && patchLinesMap.find(files[idx].second) == patchLinesMap.end() &&
+		file::normalize(importFile.bytes, importFile.transform))
+		importFile.normalizedSize = (long long)importFile.bytes.size();
+	if (patchLinesMap.find(files[idx].second) != patchLinesMap.end())
+		importFile.bytes.clear();
+	else if (importFile.size > 0 && isDuplicate(importFile.sourceHash, idx))
+	{
+		importFile.duplicate = true;
+		return importFile;
+	}
+	else
+	{
+		importFile.sketch = file::sketch::compute(importFile.bytes.data(), importFile.bytes.size());
+		encodeFile(importFile, idx);
+		return importFile;
+	}
+
+	if (!hashingAlgorithm.empty())
+		importFile.hash = file::hash::compute(importFile.bytes, hashingAlgorithm);
+	return importFile;
+}
 
-				command cmd3(
-					*db, "INSERT INTO mediatag (tag_id, media_id) VALUES(:tag_id, :media_id) ON CONFLICT DO NOTHING");
-				cmd3.bind(":tag_id", tagId);
-				cmd3.bind(":media_id", mediaId);
-				cmd3.execute();
+void Romdb::SystemImporter::consumeFile(size_t idx, ImportFile& importFile)
+{
+	auto mediaId = files[idx].first;
+	auto imported = findImported(mediaId, files[idx].second);
+	if (importFile.exists && !importFile.unchanged && patchLinesMap.find(files[idx].second) == patchLinesMap.end() &&
+		importFile.size > 0)
+	{
+		// the row of a changed file doesn't have the content of its manifest anymore
+		if (imported)
+		{
+			auto it = contentIds.find(imported->hash);
+			if (it != contentIds.end() && it->second == imported->id)
+				contentIds.erase(it);
+		}
+
+		auto it = contentIds.find(importFile.sourceHash);
+		if (it != contentIds.end())
+		{
+			importFile.aliasId = it->second;
+			importFile.bytes.clear();
+			// an alias has the content of its parent, so it's normalized like it
+			importFile.transform = {};
+			if (romdb.getTransform(importFile.aliasId, importFile.transform))
+			{
+				query qry(db, "SELECT size FROM file WHERE id = :id");
+				qry.bind(":id", importFile.aliasId);
+				for (const auto& row : qry)
+					importFile.normalizedSize = row.get<long long>(0);
 			}
+			importFile.sketch.clear();
+			importFile.compressed = false;
+			importFile.hash =
+				hashingAlgorithm.empty() ? std::string() : file::hash::compute(importFile.bytes, hashingAlgorithm);
+			duplicateFileCount++;
+		}
+		else if (importFile.duplicate)
+		{
+			// the file it was a duplicate of wasn't stored
+			importFile.sketch = file::sketch::compute(importFile.bytes.data(), importFile.bytes.size());
+			encodeFile(importFile, idx);
 		}
+		if (!importFile.chunks.empty())
+			writeChunks(importFile);
 	}
+	if (importFile.exists)
+	{
+		replacedFiles = replacedFiles || (imported && !importFile.unchanged);
+		auto fileId = writeFile(
+			mediaId, files[idx].second, importFile, importFile.compressed, importFile.aliasId, imported);
+		if (fileId && !importFile.aliasId && !importFile.sourceHash.empty() && importFile.size > 0 &&
+			!importFile.bytes.empty())
+			contentIds.emplace(importFile.sourceHash, fileId);
+		if (fileId && !importFile.sketch.empty())
+			sketchedFileIds.push_back(fileId);
+	}
+	if (idx + 1 == files.size() || files[idx + 1].first != mediaId)
+	{
+		addJournal("media", mediaId);
+		tx->checkpoint();
+	}
+}
 
-	// load patch
-	utils::stringMapNoCase<std::string> patchLinesMap;
-	utils::stringMapNoCase<long long> patchIds;
-	utils::stringMapNoCase<long long> patchParentIds;
-	while (true)
+void Romdb::SystemImporter::groupPatches()
+{
+	// update patch parent ids that are 0 (parent files from another system)
+	for (auto& patchParentId : patchParentIds)
 	{
-		auto patchFilePath = getImportFile(importPath, "patch", configName);
-		if (!fs::exists(patchFilePath) || fs::is_directory(patchFilePath))
+		if (patchParentId.second)
+			continue;
+
+		auto& qry = stmts.getQuery("SELECT id FROM file WHERE name = :name AND media_id NOT IN (SELECT id FROM media "
+								   "WHERE system_id = :system_id)");
+		qry.bind(":name", patchParentId.first, nocopy);
+		qry.bind(":system_id", systemId);
+		for (const auto& row : qry)
 		{
+			patchParentId.second = row.get<long long>(0);
 			break;
 		}
-		auto patchLines = utils::splitStringInLines(file::readText(patchFilePath.string()));
-		if (patchLines.empty())
+	}
+
+	// unchanged patch files are patched again if their parent changed or is another file, or if an import that
+	// didn't finish stored them before patching them
+	for (const auto& unchangedPatchFile : unchangedPatchFiles)
+	{
+		const auto& parentFile = patchLinesMap[unchangedPatchFile.first];
+		auto patchParentIt = patchParentIds.find(parentFile);
+		if (patchParentIt == patchParentIds.end() || !patchParentIt->second)
+			continue;
+		auto imported = unchangedPatchFile.second;
+		if (!imported->hasData || changedFiles.count(parentFile) ||
+			(imported->parentId && imported->parentId != patchParentIt->second))
+			patchIds[unchangedPatchFile.first] = imported->id;
+	}
+
+	// group patches by parent file
+	utils::stringMapNoCase<std::vector<std::string>> patchGroupsMap;
+	for (const auto& patchLine : patchLinesMap)
+	{
+		if (patchIds.find(patchLine.first) == patchIds.end())
+			continue;
+		if (patchParentIds.find(patchLine.second) == patchParentIds.end())
+			continue;
+		patchGroupsMap[patchLine.second].push_back(patchLine.first);
+	}
+	for (auto& patchGroup : patchGroupsMap)
+	{
+		if (!journal.count({ "patch", patchParentIds[patchGroup.first] }))
+			patchGroups.emplace_back(patchGroup.first, std::move(patchGroup.second));
+	}
+
+	// patches are made of the normalized content of their parent, which is only stored yet if it isn't patched too.
+	// the transforms of stored parents are looked up here, before the groups are dispatched to the workers
+	normalizeParents.resize(patchGroups.size());
+	for (size_t idx = 0; idx < patchGroups.size(); idx++)
+	{
+		const auto& parent = patchGroups[idx].first;
+		file::Transform parentTransform;
+		normalizeParents[idx] =
+			patchIds.count(parent) ? normalizeFiles : romdb.getTransform(patchParentIds.at(parent), parentTransform);
+	}
+
+	// the workers compare patches with their file compressed whole before the patches of the parent chain are
+	// written. the chain of a parent patched by this import may grow up to the chain of its own parent
+	maxChainSizes.resize(patchGroups.size());
+	for (size_t idx = 0; idx < patchGroups.size(); idx++)
+	{
+		auto file = patchGroups[idx].first;
+		for (size_t depth = 0; depth < maxChainDepth; depth++)
 		{
+			maxChainSizes[idx] += getChainSize(patchParentIds.at(file));
+			auto patchLineIt = patchLinesMap.find(file);
+			if (!patchIds.count(file) || patchLineIt == patchLinesMap.end() ||
+				!patchParentIds.count(patchLineIt->second))
+				break;
+			file = patchLineIt->second;
+		}
+	}
+}
+
+long long Romdb::SystemImporter::getChainSize(long long fileId)
+{
+	long long chainSize = 0;
+	auto& qry = stmts.getQuery("SELECT parent_id, size FROM file WHERE id = :file_id");
+	for (size_t depth = 0; fileId && depth < maxChainDepth; depth++)
+	{
+		qry.reset();
+		qry.bind(":file_id", fileId);
+		fileId = 0;
+		for (const auto& row : qry)
+		{
+			fileId = row.column_type(0) != SQLITE_NULL ? row.get<long long>(0) : 0;
+			chainSize += row.get<long long>(1);
 			break;
 		}
-		std::string val;
-		for (const auto& line : patchLines)
+	}
+	return chainSize;
+}
+
+bool Romdb::SystemImporter::isPatchCheaper(size_t patchSize, size_t standaloneSize, long long parentId)
+{
+	return patchSize + patchCostWeight * getChainSize(parentId) < standaloneSize;
+}
+
+void Romdb::SystemImporter::createOtherPatches(const std::vector<char>& input, const std::vector<char>& output,
+	const std::string& algorithm, ImportPatch& importPatch) const
+{
+	for (auto engine : patchEngines)
+	{
+		std::vector<char> bytes;
+		if (engine->id() == vcdiffEngine ||
+			!engine->createPatch(input.data(), input.size(), output.data(), output.size(), bytes))
+			continue;
+		auto compressed = file::compress(bytes, algorithm);
+		if (!importPatch.hasPatch || bytes.size() < importPatch.bytes.size())
+		{
+			importPatch.bytes = std::move(bytes);
+			importPatch.hasPatch = true;
+			importPatch.compressed = compressed;
+			importPatch.engine = engine->id();
+		}
+	}
+}
+
+void Romdb::SystemImporter::importPatches()
+{
+	patchCompressionAlgorithm = blobCompression(compressionAlgorithm);
+	pipeline::ordered(
+		patchGroups.size(), romdb.jobs, romdb.jobs * 2, [this](size_t idx) { return encodePatchGroup(idx); },
+		[this](size_t idx, ImportPatchGroup& importGroup) { writePatchGroup(idx, importGroup); });
+	if (standaloneFileCount)
+		std::cout << "not patched : " << standaloneFileCount << " files cheaper to store whole" << std::endl;
+}
+
+ImportPatchGroup Romdb::SystemImporter::encodePatchGroup(size_t idx)
+{
+	auto start = std::chrono::steady_clock::now();
+	const auto& patchGroup = patchGroups[idx];
+	auto file1Path = romsPath / patchGroup.first;
+
+	// parents from another system aren't in the roms path and are reconstructed from the database
+	auto parentId = patchParentIds.at(patchGroup.first);
+	file::Transform parentTransform;
+	bool normalizeParent = normalizeParents[idx];
+	std::optional<file::PatchGroupEncoder> encoder;
+	std::vector<char> file1Bytes;
+	if (fs::exists(file1Path) && !normalizeParent)
+	{
+		if (vcdiffPatches)
 		{
-			if (line.empty())
+			encoder.emplace(file1Path.string(),
+				romdb.patchWindowSize ? romdb.patchWindowSize : file::defaultPatchWindowSize, encoderProfile);
+		}
+		if (otherPatches)
+			file1Bytes = file::readBytes(file1Path.string());
+	}
+	else
+	{
+		if (fs::exists(file1Path))
+		{
+			file1Bytes = file::readBytes(file1Path.string());
+			file::normalize(file1Bytes, parentTransform);
+		}
+		else
+			file1Bytes = romdb.getNormalizedFile(parentId);
+		if (vcdiffPatches)
+			encoder.emplace(otherPatches ? file1Bytes : std::move(file1Bytes), encoderProfile);
+	}
+
+	// files are patched from memory when they're normalized or patched by other engines
+	bool readFiles = normalizeFiles || otherPatches;
+	ImportPatchGroup importGroup;
+	for (const auto& file : patchGroup.second)
+	{
+		auto file2Path = romsPath / file;
+		ImportPatch importPatch;
+		std::vector<char> file2Bytes;
+		if (readFiles)
+		{
+			file2Bytes = file::readBytes(file2Path.string());
+			if (normalizeFiles)
+				file::normalize(file2Bytes, importPatch.transform);
+			importPatch.size = (long long)file2Bytes.size();
+		}
+		else
+			importPatch.size = (long long)fs::file_size(file2Path);
+		if (encoder)
+		{
+			if (readFiles)
 			{
-				val.clear();
-				continue;
+				importPatch.hasPatch = encoder->createPatch(file2Bytes.data(), file2Bytes.size(), importPatch.bytes);
+				if (!importPatch.hasPatch)
+					importPatch.bytes = file2Bytes;
 			}
-			if (val.empty())
+			else
+				importPatch.hasPatch = encoder->createPatch(file2Path.string(), importPatch.bytes);
+			importPatch.compressed = file::compress(importPatch.bytes, patchCompressionAlgorithm);
+		}
+		if (otherPatches)
+		{
+			createOtherPatches(file1Bytes, file2Bytes, patchCompressionAlgorithm, importPatch);
+			if (!encoder && !importPatch.hasPatch)
 			{
-				val = line;
-				continue;
+				importPatch.bytes = file2Bytes;
+				importPatch.compressed = file::compress(importPatch.bytes, patchCompressionAlgorithm);
 			}
-			patchLinesMap[line] = val;
-			patchParentIds[val] = 0;
 		}
-		break;
-	}
+		if (!hashingAlgorithm.empty())
+			importPatch.hash = file::hash::compute(importPatch.bytes, hashingAlgorithm);
 
-	// import files
-	{
-		utils::stringSetNoCase fileLinesSet(fileLines.begin(), fileLines.end());
+		// a patch much smaller than its file is kept right away. otherwise the file is compressed whole, and only
+		// kept for the comparison with the actual chain of the parent if the patch may not be cheaper
+		auto maxPatchCost = importPatch.bytes.size() + patchCostWeight * maxChainSizes[idx];
+		if (importPatch.hasPatch && maxPatchCost >= importPatch.size * patchCheapFraction)
+		{
+			auto bytes = readFiles ? std::move(file2Bytes) : file::readBytes(file2Path.string());
+			auto compressed = file::compress(bytes, patchCompressionAlgorithm);
+			if (maxPatchCost >= bytes.size())
+			{
+				importPatch.standaloneBytes = std::move(bytes);
+				importPatch.standaloneCompressed = compressed;
+				if (!hashingAlgorithm.empty())
+					importPatch.standaloneHash = file::hash::compute(importPatch.standaloneBytes, hashingAlgorithm);
+			}
+		}
+		importGroup.patches.push_back(std::move(importPatch));
+	}
+	importGroup.elapsed = std::chrono::steady_clock::now() - start;
+	return importGroup;
+}
 
-		using MediaFile = std::pair<long long, std::vector<std::string>>;
-		std::deque<MediaFile> filesToInsert;
+void Romdb::SystemImporter::writePatchGroup(size_t idx, ImportPatchGroup& importGroup)
+{
+	const auto& patchGroup = patchGroups[idx];
+	auto parentId = patchParentIds[patchGroup.first];
 
-		// group files to media
-		query qry(*db, "SELECT id, name FROM media WHERE system_id = :system_id ORDER BY name COLLATE NOCASE DESC");
-		qry.bind(":system_id", systemId);
-		for (const auto& row : qry)
+	for (size_t i = 0; i < patchGroup.second.size(); i++)
+	{
+		auto& importPatch = importGroup.patches[i];
+		auto fileId = patchIds[patchGroup.second[i]];
+		if (importPatch.hasPatch && !importPatch.standaloneBytes.empty() &&
+			!isPatchCheaper(importPatch.bytes.size(), importPatch.standaloneBytes.size(), parentId))
 		{
-			auto mediaId = row.get<long long>(0);
-			auto mediaName = row.get<std::string>(1);
-			auto filteredFiles = utils::filterStrings(fileLinesSet, mediaName);
-			filesToInsert.push_front({ mediaId, filteredFiles });
+			importPatch.bytes = std::move(importPatch.standaloneBytes);
+			importPatch.compressed = importPatch.standaloneCompressed;
+			importPatch.hash = std::move(importPatch.standaloneHash);
+			importPatch.hasPatch = false;
+			standaloneFileCount++;
 		}
 
-		auto fileTags = getTags(importPath / "filetag");
+		auto compression = importPatch.compressed ? patchCompressionAlgorithm : std::string();
+		if (importPatch.hasPatch)
+			compression = patchCompression(importPatch.engine, compression);
+		auto& cmd = stmts.getCommand("UPDATE file SET data = :data, size = :size, compression = :compression, "
+									 "parent_id = :parent_id WHERE id = :file_id");
+		cmd.bind(":data", importPatch.bytes.data(), importPatch.bytes.size(), nocopy);
+		cmd.bind(":size", importPatch.size);
+		if (!compression.empty())
+			cmd.bind(":compression", compression, nocopy);
+		else
+			cmd.bind(":compression");
+		if (importPatch.hasPatch)
+			cmd.bind(":parent_id", parentId);
+		else
+			cmd.bind(":parent_id");
+		cmd.bind(":file_id", fileId);
+		cmd.execute();
+
+		upsertChecksum(stmts, fileId, hashingAlgorithm, importPatch.hash);
+		writeTransform(stmts, fileId, importPatch.transform);
+		tx->step();
+	}
+
+	addJournal("patch", parentId);
+	tx->checkpoint();
+
+	auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(importGroup.elapsed).count();
+	std::cout << "patch       : " << patchGroup.first << " (" << patchGroup.second.size() << " files, " << elapsedMs
+			  << " ms)" << std::endl;
+}
+
+void Romdb::SystemImporter::importAutoPatches()
+{
+	findAutoPatches();
 
-		// insert files
-		for (auto& files : filesToInsert)
+	// patches are encoded on worker threads and written in order on this thread
+	pipeline::ordered(
+		autoPatches.size(), romdb.jobs, romdb.jobs * 2, [this](size_t idx) { return encodeAutoPatch(idx); },
+		[this](size_t idx, ImportPatch& importPatch) { writeAutoPatch(idx, importPatch); });
+	if (autoPatchCount)
+	{
+		std::cout << "auto patched: " << autoPatchCount << " files, " << autoPatchSavedBytes / 1024 << " KB saved"
+				  << std::endl;
+	}
+}
+
+void Romdb::SystemImporter::findAutoPatches()
+{
+	std::unordered_map<uint64_t, std::vector<long long>> sketchIndex;
+	auto& qry = stmts.getQuery("SELECT s.file_id, s.data, f.name, LENGTH(f.data) FROM sketch s JOIN file f ON f.id = "
+							   "s.file_id WHERE f.parent_id IS NULL AND LENGTH(f.data) > 0");
+	for (const auto& row : qry)
+	{
+		auto fileId = row.get<long long>(0);
+		auto& sketchedFile = sketchedFiles[fileId];
+		sketchedFile.sketch = readUint64s((const char*)row.get<const void*>(1), row.column_bytes(1));
+		sketchedFile.name = row.get<std::string>(2);
+		sketchedFile.dataSize = (size_t)row.get<long long>(3);
+		for (size_t i = 0; i < std::min(sketchedFile.sketch.size(), autoPatchIndexSize); i++)
+			sketchIndex[sketchedFile.sketch[i]].push_back(fileId);
+	}
+
+	std::unordered_set<long long> parentIds;
+	std::unordered_set<long long> patchedIds;
+	for (auto fileId : sketchedFileIds)
+	{
+		auto sketchedIt = sketchedFiles.find(fileId);
+		if (sketchedIt == sketchedFiles.end() || parentIds.count(fileId))
+			continue;
+		const auto& sketch = sketchedIt->second.sketch;
+
+		// files sharing the most of the smallest hashes are the candidates
+		std::unordered_map<long long, size_t> hits;
+		for (size_t i = 0; i < std::min(sketch.size(), autoPatchIndexSize); i++)
 		{
-			std::vector<char> archBytes;
-			std::unique_ptr<Archive> arch;
-			bool archiveFile = true;
-			long long archiveParentId = 0;
-			auto mediaId = files.first;
-			for (size_t fileIdx = 0; fileIdx < files.second.size(); fileIdx++)
+			auto indexIt = sketchIndex.find(sketch[i]);
+			if (indexIt == sketchIndex.end())
+				continue;
+			for (auto candidateId : indexIt->second)
 			{
-				const auto file = files.second[fileIdx];
-				if (file.empty())
-					continue;
-
-				auto filePath = romsPath / file;
-				if (!importArchives || (importArchives && archiveFile))
-				{
-					if (!fs::exists(filePath) || fs::is_directory(filePath))
-					{
-						continue;
-					}
-				}
-				std::vector<char> fileBytes;
-				long long uncompressedFileSize = 0;
-				bool fileCompressed = false;
-				if (patchLinesMap.find(file) == patchLinesMap.end())
-				{
-					if (importArchives)
-					{
-						if (!arch)
-						{
-							archBytes = file::readBytes(filePath.string());
-							uncompressedFileSize = archBytes.size();
-							arch = Archive::openArchive(archBytes.data(), archBytes.size());
-							if (!arch)
-								continue;
-							for (const auto& name : arch->getFileNames())
-								files.second.push_back(name);
-						}
-					}
-					else
-					{
-						fileBytes = file::readBytes(filePath.string());
-						uncompressedFileSize = fileBytes.size();
-						fileCompressed = file::compress(fileBytes, compressionAlgorithm);
-					}
-				}
-				else
-					uncompressedFileSize = fs::file_size(filePath);
+				if (candidateId != fileId && !patchedIds.count(candidateId))
+					hits[candidateId]++;
+			}
+		}
+		std::vector<std::pair<size_t, long long>> candidates;
+		for (const auto& hit : hits)
+			candidates.emplace_back(hit.second, hit.first);
+		auto candidatesEnd = candidates.begin() + std::min(candidates.size(), autoPatchCandidates);
+		auto moreHits = [](const auto& a, const auto& b) {
+			return a.first != b.first ? a.first > b.first : a.second < b.second;
+		};
+		std::partial_sort(candidates.begin(), candidatesEnd, candidates.end(), moreHits);
+
+		AutoPatch autoPatch;
+		for (auto it = candidates.begin(); it != candidatesEnd; ++it)
+		{
+			auto similarity = file::sketch::similarity(sketch, sketchedFiles[it->second].sketch);
+			if (similarity > autoPatch.similarity)
+				autoPatch = { fileId, it->second, similarity };
+		}
+		if (autoPatch.similarity < autoPatchMinSimilarity)
+			continue;
+		autoPatches.push_back(autoPatch);
+		parentIds.insert(autoPatch.parentId);
+		patchedIds.insert(fileId);
+	}
+}
 
-				command cmd(*db,
-					"INSERT INTO file (name, data, size, compression, media_id, parent_id) VALUES(:name, :data, "
-					":size, :compression, :media_id, :parent_id) ON CONFLICT DO NOTHING");
-				cmd.bind(":name", file, nocopy);
-				if (importArchives)
-				{
-					if (!archBytes.empty() && archiveFile)
-						cmd.bind(":data", archBytes.data(), archBytes.size(), nocopy);
-					else
-						cmd.bind(":data");
-				}
-				else
-				{
-					if (!fileBytes.empty())
-						cmd.bind(":data", fileBytes.data(), fileBytes.size(), nocopy);
-					else
-						cmd.bind(":data");
-				}
-				cmd.bind(":size", uncompressedFileSize);
-				if (fileCompressed || (importArchives && archiveFile))
-					cmd.bind(":compression", compressionAlgorithm, nocopy);
-				else
-					cmd.bind(":compression");
-				cmd.bind(":media_id", mediaId);
-				if (importArchives && !archiveFile)
-					cmd.bind(":parent_id", archiveParentId);
-				auto fileInsertResult = cmd.execute();
-
-				long long fileId = 0;
-				if (fileInsertResult == SQLITE_OK)
-				{
-					query qry(*db, "SELECT id FROM file WHERE name = :name AND media_id = :media_id");
-					qry.bind(":name", file, nocopy);
-					qry.bind(":media_id", mediaId);
-					for (const auto& row : qry)
-					{
-						fileId = row.get<long long>(0);
+ImportPatch Romdb::SystemImporter::encodeAutoPatch(size_t idx)
+{
+	const auto& autoPatch = autoPatches[idx];
+	auto bytes = romdb.getNormalizedFile(autoPatch.fileId);
+	auto parentBytes = romdb.getNormalizedFile(autoPatch.parentId);
+	ImportPatch importPatch;
+	if (vcdiffPatches)
+	{
+		file::PatchGroupEncoder encoder(otherPatches ? parentBytes : std::move(parentBytes), encoderProfile);
+		importPatch.hasPatch = encoder.createPatch(bytes.data(), bytes.size(), importPatch.bytes);
+		if (importPatch.hasPatch)
+			importPatch.compressed = file::compress(importPatch.bytes, compressionAlgorithm);
+	}
+	if (otherPatches)
+		createOtherPatches(parentBytes, bytes, compressionAlgorithm, importPatch);
+	if (importPatch.hasPatch)
+	{
+		if (!hashingAlgorithm.empty())
+			importPatch.hash = file::hash::compute(importPatch.bytes, hashingAlgorithm);
+	}
+	return importPatch;
+}
 
-						if (fileBytes.empty())
-							patchIds[file] = fileId;
+void Romdb::SystemImporter::writeAutoPatch(size_t idx, ImportPatch& importPatch)
+{
+	const auto& autoPatch = autoPatches[idx];
+	const auto& sketchedFile = sketchedFiles[autoPatch.fileId];
+	if (!importPatch.hasPatch || !isPatchCheaper(importPatch.bytes.size(), sketchedFile.dataSize, autoPatch.parentId))
+		return;
 
-						auto patchParentIt = patchParentIds.find(file);
-						if (patchParentIt != patchParentIds.end())
-							patchParentIt->second = fileId;
+	auto compression =
+		patchCompression(importPatch.engine, importPatch.compressed ? compressionAlgorithm : std::string());
+	auto& cmd = stmts.getCommand(
+		"UPDATE file SET data = :data, compression = :compression, parent_id = :parent_id WHERE id = :file_id");
+	cmd.bind(":data", importPatch.bytes.data(), importPatch.bytes.size(), nocopy);
+	if (!compression.empty())
+		cmd.bind(":compression", compression, nocopy);
+	else
+		cmd.bind(":compression");
+	cmd.bind(":parent_id", autoPatch.parentId);
+	cmd.bind(":file_id", autoPatch.fileId);
+	cmd.execute();
+
+	upsertChecksum(stmts, autoPatch.fileId, hashingAlgorithm, importPatch.hash);
+	tx->step();
+	tx->checkpoint();
+
+	autoPatchCount++;
+	autoPatchSavedBytes += sketchedFile.dataSize - importPatch.bytes.size();
+	std::cout << "auto patch  : " << sketchedFile.name << " <- " << sketchedFiles[autoPatch.parentId].name
+			  << " (similarity " << autoPatch.similarity << ")" << std::endl;
+}
 
-						break;
-					}
-				}
-				if (importArchives && archiveFile)
-					archiveParentId = fileId;
+bool Romdb::importSystem(const fs::path& romsPath, const fs::path& importPath, const std::string& configName)
+{
+	SystemImporter importer(*this, romsPath, importPath, configName);
+	return importer.import();
+}
 
-				// upsert file hash
-				if (!hashingAlgorithm.empty())
-				{
-					if (importArchives)
-					{
-						if (archiveFile)
-							upsertChecksum(*db, archBytes, fileId, hashingAlgorithm);
-					}
-					else
-						upsertChecksum(*db, fileBytes, fileId, hashingAlgorithm);
-				}
+bool Romdb::getTransform(long long fileId, file::Transform& transform)
+{
+	if (!hasTransforms)
+		return false;
 
-				archiveFile = false;
+	query qry(*db, "SELECT name, data FROM transform WHERE file_id = :file_id");
+	qry.bind(":file_id", fileId);
+	for (const auto& row : qry)
+	{
+		transform.name = row.get<std::string>(0);
+		auto data = (const char*)row.get<const void*>(1);
+		transform.data.assign(data, data + row.column_bytes(1));
+		return true;
+	}
+	return false;
+}
 
-				// insert file tags
-				auto it = fileTags.find(file);
-				if (it == fileTags.end())
-					continue;
+std::vector<char> Romdb::getFile(long long fileId)
+{
+	auto bytes = getNormalizedFile(fileId);
+	file::Transform transform;
+	if (getTransform(fileId, transform))
+		restoreFile(bytes, transform, fileId);
+	return bytes;
+}
 
-				for (const auto& tag : it->second)
-				{
-					command cmd2(*db, "INSERT INTO tag (name, value) VALUES(:name, :value) ON CONFLICT DO NOTHING");
-					cmd2.bind(":name", tag.first, nocopy);
-					if (!it->second.empty())
-						cmd2.bind(":value", tag.second, nocopy);
-					else
-						cmd2.bind(":value");
-
-					long long tagId = 0;
-					if (cmd2.execute() == SQLITE_OK)
-					{
-						query qry(*db, "SELECT id FROM tag WHERE name = :name AND value = :value");
-						qry.bind(":name", tag.first, nocopy);
-						if (!it->second.empty())
-							qry.bind(":value", tag.second, nocopy);
-						else
-							qry.bind(":value");
-						for (const auto& row : qry)
-						{
-							tagId = row.get<long long>(0);
-							break;
-						}
-					}
+std::vector<char> Romdb::getNormalizedFile(long long fileId)
+{
+	if (!db)
+		return {};
 
-					command cmd3(*db, "INSERT INTO filetag (tag_id, file_id) VALUES(:tag_id, "
-									  ":file_id) ON CONFLICT DO NOTHING");
-					cmd3.bind(":tag_id", tagId);
-					cmd3.bind(":file_id", fileId);
-					cmd3.execute();
-				}
-			}
-		}
-	}
+	auto cachedBytes = fileCache.get(fileId);
+	if (cachedBytes)
+		return *cachedBytes;
 
-	// import patches
-	for (const auto& patchLine : patchLinesMap)
+	// walk the parent ids of the file until the root file or a parent already reconstructed in the cache
+	std::vector<ChainFile> chain;
+	std::unordered_set<long long> chainIds;
+	FileCache::Bytes fileBytes;
 	{
-		// update patch parent ids that are 0 (parent files from another system)
-		for (auto& patchParentId : patchParentIds)
+		query qry(*db, "SELECT parent_id, name, LENGTH(data), size, IFNULL(compression, '') FROM file WHERE id = "
+					   ":file_id");
+		auto id = fileId;
+		while (true)
 		{
-			if (patchParentId.second)
-				continue;
+			if (!chainIds.insert(id).second)
+			{
+				throw std::runtime_error("invalid patch chain for file id " + std::to_string(fileId) +
+										 ": loops at file id " + std::to_string(id));
+			}
+			if (chainIds.size() > maxChainDepth)
+			{
+				throw std::runtime_error("invalid patch chain for file id " + std::to_string(fileId) +
+										 ": deeper than " + std::to_string(maxChainDepth) + " files");
+			}
 
-			query qry(*db, "SELECT id FROM file WHERE name = :name AND media_id NOT IN (SELECT id FROM media "
-						   "WHERE system_id = :system_id)");
-			qry.bind(":name", patchParentId.first, nocopy);
-			qry.bind(":system_id", systemId);
+			qry.reset();
+			qry.bind(":file_id", id);
+			long long parentId = 0;
+			bool found = false;
 			for (const auto& row : qry)
 			{
-				patchParentId.second = row.get<long long>(0);
+				ChainFile chainFile;
+				chainFile.id = id;
+				chainFile.name = row.get<std::string>(1);
+				chainFile.hasData = row.column_type(2) != SQLITE_NULL;
+				chainFile.dataSize = chainFile.hasData ? (size_t)row.get<long long>(2) : 0;
+				chainFile.size = (size_t)row.get<long long>(3);
+				chainFile.compression = row.get<std::string>(4);
+				chain.push_back(std::move(chainFile));
+				parentId = row.get<long long>(0);
+				found = true;
 				break;
 			}
-		}
-
-		long long fileId = 0;
-		long long parentId = 0;
-		{
-			auto it = patchIds.find(patchLine.first);
-			if (it == patchIds.end())
-				continue;
-			fileId = it->second;
+			if (!found || !parentId)
+				break;
 
-			auto it2 = patchParentIds.find(patchLine.second);
-			if (it2 == patchParentIds.end())
-				continue;
-			parentId = it2->second;
+			fileBytes = fileCache.get(parentId);
+			if (fileBytes)
+				break;
+			id = parentId;
 		}
+	}
 
-		auto file1Path = romsPath / patchLine.second;
-		auto file2Path = romsPath / patchLine.first;
-		std::vector<char> fileBytes;
-		bool hasPatch = file::createPatch(file1Path.string(), file2Path.string(), fileBytes);
-		bool bytesCompressed = file::compress(fileBytes, compressionAlgorithm);
-
-		command cmd(*db, "UPDATE file SET data = :data, compression = :compression, parent_id = :parent_id "
-						 "WHERE id = :file_id");
-		cmd.bind(":data", fileBytes.data(), fileBytes.size(), nocopy);
-		if (bytesCompressed)
-			cmd.bind(":compression", compressionAlgorithm, nocopy);
-		else
-			cmd.bind(":compression");
-		if (hasPatch)
-			cmd.bind(":parent_id", parentId);
-		else
-			cmd.bind(":parent_id");
-		cmd.bind(":file_id", fileId);
-		cmd.execute();
-
-		if (!hashingAlgorithm.empty())
-			upsertChecksum(*db, fileBytes, fileId, hashingAlgorithm);
+	// reconstruct from the root file (or cached parent) to the file, reading each blob by rowid
+	BlobReader blobReader(*db, "file", "data");
+	ChunkReader chunkReader(*db);
+	for (const auto& file : utils::reverse(chain))
+	{
+		fileBytes =
+			std::make_shared<const std::vector<char>>(buildFile(blobReader, chunkReader, file, fileBytes.get()));
+		fileCache.put(file.id, fileBytes);
 	}
-	return true;
+	return fileBytes ? *fileBytes : std::vector<char>();
 }
 
-std::vector<char> Romdb::getFile(long long fileId)
+std::unique_ptr<file::Reader> Romdb::openFile(long long fileId)
 {
 	if (!db)
 		return {};
 
-	std::vector<char> fileBytes;
-	query qry(*db,
-		"WITH RECURSIVE file2(name, data, datalength, size, compression, id, parent_id, idx) AS (SELECT name, data, "
-		"LENGTH(data) datalength, size, IFNULL(compression, '') compression, id, parent_id, 1 FROM file WHERE id "
-		"= :file_id UNION ALL SELECT f.name, f.data, LENGTH(f.data) datalength, f.size, IFNULL(f.compression, '') "
-		"compression, f.id, f.parent_id, idx + 1 FROM file f, file2 WHERE file2.parent_id = f.id LIMIT 20) SELECT "
-		"DISTINCT name, data, datalength, size, compression FROM file2 ORDER BY idx DESC");
+	// the cache has the normalized content of files, which is restored in memory
+	file::Transform transform;
+	if (getTransform(fileId, transform))
+		return std::make_unique<file::MemoryReader>(std::make_shared<const std::vector<char>>(getFile(fileId)));
+
+	auto cachedBytes = fileCache.get(fileId);
+	if (cachedBytes)
+		return std::make_unique<file::MemoryReader>(cachedBytes);
+
+	// only standalone files are streamed, patched files and archive files need their parent reconstructed
+	query qry(*db, "SELECT parent_id IS NULL AND data IS NOT NULL, IFNULL(compression, '') FROM file WHERE id = :file_id");
 	qry.bind(":file_id", fileId);
-	for (const auto& file : qry)
+	for (const auto& row : qry)
 	{
-		auto data = file.get<void const*>(1);
-		auto size = (size_t)file.get<long long>(2);
-		auto uncompressedSize = (size_t)file.get<long long>(3);
-		auto compression = file.get<std::string>(4);
-		auto parentId = file.get<long long>(5);
+		if (!row.get<int>(0))
+			return std::make_unique<file::MemoryReader>(std::make_shared<const std::vector<char>>(getFile(fileId)));
+
+		auto compression = row.get<std::string>(1);
+		if (isChunkCompression(compression))
+			return std::make_unique<ChunkStream>(*db, BlobReader(*db, "file", "data").read(fileId));
+		return file::openUncompressReader(std::make_unique<BlobStream>(*db, "file", "data", fileId), compression);
+	}
+	return {};
+}
 
-		if (fileBytes.empty())
+void Romdb::dumpSystemFiles(long long systemId, const fs::path& filesPath, std::string& fileText)
+{
+	// patch family trees of the files to dump. parents can be in another system and aren't dumped then
+	struct DumpNode
+	{
+		std::string name;
+		bool dump = false;
+		long long parentId = 0;
+		long long size = 0;
+		std::vector<long long> children;
+	};
+	std::unordered_map<long long, DumpNode> nodes;
+	{
+		query qry(*db, "SELECT id, name, parent_id, size FROM file WHERE media_id IN (SELECT id FROM media WHERE "
+					   "system_id = :system_id) AND data IS NOT NULL AND size > 0");
+		qry.bind(":system_id", systemId);
+		for (const auto& file : qry)
+		{
+			auto& node = nodes[file.get<long long>(0)];
+			node.name = file.get<std::string>(1);
+			node.dump = true;
+			node.parentId = file.column_type(2) != SQLITE_NULL ? file.get<long long>(2) : 0;
+			node.size = file.get<long long>(3);
+			fileText += node.name + "\n";
+		}
+	}
+	{
+		query qry(*db, "SELECT parent_id, size FROM file WHERE id = :file_id");
+		std::vector<long long> missingIds;
+		for (const auto& node : nodes)
 		{
-			fileBytes = std::vector<char>((const char*)data, (const char*)data + size);
-			file::uncompress(fileBytes, uncompressedSize, compression);
+			if (node.second.parentId && !nodes.count(node.second.parentId))
+				missingIds.push_back(node.second.parentId);
 		}
-		else if (!data && !uncompressedSize)
+		while (!missingIds.empty())
 		{
-			auto archive = Archive::openArchive(fileBytes.data(), fileBytes.size());
-			if (archive)
+			auto id = missingIds.back();
+			missingIds.pop_back();
+			if (nodes.count(id))
+				continue;
+			auto& node = nodes[id];
+			qry.reset();
+			qry.bind(":file_id", id);
+			for (const auto& file : qry)
 			{
-				auto name = file.get<std::string>(0);
-				fileBytes = archive->getFile(name);
+				node.parentId = file.column_type(0) != SQLITE_NULL ? file.get<long long>(0) : 0;
+				node.size = file.get<long long>(1);
+				break;
 			}
+			if (node.parentId && !nodes.count(node.parentId))
+				missingIds.push_back(node.parentId);
+		}
+	}
+
+	// normalized files are restored before they're written
+	std::unordered_map<long long, file::Transform> transforms;
+	if (hasTransforms)
+	{
+		query qry(*db, "SELECT file_id, name, data FROM transform WHERE file_id IN (SELECT id FROM file WHERE media_id "
+					   "IN (SELECT id FROM media WHERE system_id = :system_id))");
+		qry.bind(":system_id", systemId);
+		for (const auto& row : qry)
+		{
+			auto& transform = transforms[row.get<long long>(0)];
+			transform.name = row.get<std::string>(1);
+			auto data = (const char*)row.get<const void*>(2);
+			transform.data.assign(data, data + row.column_bytes(2));
 		}
+	}
+
+	// one task per family, the families that take longest to reconstruct first
+	std::vector<std::pair<long long, long long>> families;
+	for (auto& node : nodes)
+	{
+		if (node.second.parentId)
+			nodes.at(node.second.parentId).children.push_back(node.first);
 		else
+			families.emplace_back(0, node.first);
+	}
+	size_t familyNodes = 0;
+	for (auto& family : families)
+	{
+		std::vector<long long> ids{ family.second };
+		while (!ids.empty())
 		{
-			auto patchBytes = std::vector<char>((const char*)data, (const char*)data + size);
-			file::uncompress(patchBytes, uncompressedSize, compression);
-			fileBytes = file::applyPatch(
-				fileBytes.data(), fileBytes.size(), patchBytes.data(), patchBytes.size(), uncompressedSize);
+			const auto& node = nodes.at(ids.back());
+			ids.pop_back();
+			family.first += node.size;
+			ids.insert(ids.end(), node.children.begin(), node.children.end());
+			familyNodes++;
 		}
 	}
-	return fileBytes;
+	if (familyNodes != nodes.size())
+	{
+		// files left out of every family are in a patch chain that loops
+		throw std::runtime_error("invalid patch chain in system id " + std::to_string(systemId));
+	}
+	std::sort(families.begin(), families.end(), [](const auto& lhs, const auto& rhs) {
+		return lhs.first != rhs.first ? lhs.first > rhs.first : lhs.second < rhs.second;
+	});
+
+	pipeline::stealing(families.size(), jobs, [&](size_t idx) {
+		auto rootId = families[idx].second;
+		const auto& root = nodes.at(rootId);
+
+		// files no other file is patched from are streamed
+		if (root.dump && root.children.empty())
+		{
+			auto reader = openFile(rootId);
+			if (reader)
+				file::writeReader((filesPath / root.name).string(), *reader);
+			return;
+		}
+
+		// the others are reconstructed from their parent, so each base is decoded once per family
+		BlobReader blobReader(*db, "file", "data");
+		ChunkReader chunkReader(*db);
+		query qry(*db, "SELECT name, LENGTH(data), size, IFNULL(compression, '') FROM file WHERE id = :file_id");
+		std::vector<std::pair<long long, FileCache::Bytes>> stack{ { rootId, nullptr } };
+		while (!stack.empty())
+		{
+			auto [id, parentBytes] = std::move(stack.back());
+			stack.pop_back();
+			const auto& node = nodes.at(id);
+
+			auto bytes = fileCache.get(id);
+			if (!bytes)
+			{
+				ChainFile chainFile;
+				chainFile.id = id;
+				qry.reset();
+				qry.bind(":file_id", id);
+				for (const auto& file : qry)
+				{
+					chainFile.name = file.get<std::string>(0);
+					chainFile.hasData = file.column_type(1) != SQLITE_NULL;
+					chainFile.dataSize = chainFile.hasData ? (size_t)file.get<long long>(1) : 0;
+					chainFile.size = (size_t)file.get<long long>(2);
+					chainFile.compression = file.get<std::string>(3);
+					break;
+				}
+				bytes = std::make_shared<const std::vector<char>>(
+					buildFile(blobReader, chunkReader, chainFile, parentBytes.get()));
+				fileCache.put(id, bytes);
+			}
+			auto transformIt = transforms.find(id);
+			if (node.dump && transformIt != transforms.end())
+			{
+				auto restoredBytes = *bytes;
+				restoreFile(restoredBytes, transformIt->second, id);
+				file::writeBytes((filesPath / node.name).string(), restoredBytes.data(), restoredBytes.size());
+			}
+			else if (node.dump)
+				file::writeBytes((filesPath / node.name).string(), bytes->data(), bytes->size());
+			for (auto childId : node.children)
+				stack.emplace_back(childId, bytes);
+		}
+	});
 }
 
 bool Romdb::dump(const std::string& dumpPath_, bool fullDump)
@@ -713,11 +2610,13 @@ bool Romdb::dump(const std::string& dumpPath_, bool fullDump)
 			std::string compression = "none";
 			query qry(*db,
 				"SELECT LOWER(compression) FROM file WHERE compression IS NOT NULL AND media_id IN (SELECT id "
-				"FROM media WHERE system_id = 1) LIMIT 1");
+				"FROM media WHERE system_id = :system_id) ORDER BY parent_id IS NOT NULL LIMIT 1");
 			qry.bind(":system_id", systemId);
 			for (const auto& val : qry)
 			{
-				compression = val.get<std::string>(0);
+				compression = patchBlobCompression(val.get<std::string>(0));
+				if (compression.empty())
+					compression = "none";
 				hasArchives = compression == "archive";
 				break;
 			}
@@ -752,23 +2651,7 @@ bool Romdb::dump(const std::string& dumpPath_, bool fullDump)
 		{
 			filesPath = systemPath;
 		}
-		{
-			query qry(*db, "SELECT id, name FROM file WHERE media_id IN (SELECT id FROM media "
-						   "WHERE system_id = :system_id) AND data IS NOT NULL AND size > 0");
-			qry.bind(":system_id", systemId);
-			for (const auto& file : qry)
-			{
-				auto fileId = file.get<long long>(0);
-				auto fileName = file.get<std::string>(1);
-				auto fileData = getFile(fileId);
-
-				if (fullDump)
-					fileText += fileName + "\n";
-
-				auto filePath = filesPath / fileName;
-				file::writeBytes(filePath.string(), fileData.data(), fileData.size());
-			}
-		}
+		dumpSystemFiles(systemId, filesPath, fileText);
 		if (!fullDump)
 			continue;
 
@@ -781,8 +2664,8 @@ bool Romdb::dump(const std::string& dumpPath_, bool fullDump)
 			std::string patchText;
 			std::string currentPatchKey;
 			query qry(*db, "SELECT f2.name parent, f1.name name FROM file f1, file f2 WHERE f1.parent_id IS NOT "
-						   "NULL AND f1.parent_id = f2.id AND f2.media_id IN (SELECT id FROM media WHERE system_id = "
-						   ":system_id) ORDER BY parent, name COLLATE NOCASE");
+						   "NULL AND f1.parent_id = f2.id AND LENGTH(f1.data) > 0 AND f2.media_id IN (SELECT id FROM "
+						   "media WHERE system_id = :system_id) ORDER BY parent, name COLLATE NOCASE");
 			qry.bind(":system_id", systemId);
 			for (const auto& patch : qry)
 			{
@@ -871,61 +2754,481 @@ bool Romdb::dump(const std::string& dumpPath_, bool fullDump)
 	return true;
 }
 
-void Romdb::verify()
+bool Romdb::verify(bool content)
 {
 	if (!db)
-		return;
+		return false;
 
-	for (const auto& system : query(*db, "SELECT id, name, code FROM system"))
+	// one ordered scan of every file and its checksum, the first checksum by name if a file has many
+	struct VerifySystem
 	{
-		auto systemId = system.get<long long>(0);
-		auto systemName = system.get<std::string>(1);
-		auto systemCode = system.get<std::string>(2);
-		long long filesGood = 0;
-		long long filesBad = 0;
-		long long filesNoChecksum = 0;
-
-		std::cout << systemCode << " - " << systemName << std::endl;
+		std::string code;
+		std::string name;
+		size_t firstFile = 0;
+		size_t lastFile = 0;
+	};
+	struct VerifyFile
+	{
+		long long id = 0;
+		std::string name;
+		bool hasData = false;
+		long long size = 0;
+		std::string checksumName;
+		std::string checksumHash;
+		// sha1 of the source file from its manifest, which the reconstructed file is checked against
+		std::string contentHash;
+	};
+	std::vector<VerifySystem> systems;
+	std::vector<VerifyFile> files;
+	{
+		long long systemId = 0;
+		long long fileId = 0;
+		query qry(*db, "SELECT s.id, s.code, s.name, f.id, f.name, f.data IS NOT NULL, f.size, LOWER(c.name), "
+					   "LOWER(c.data) FROM system s LEFT JOIN media m ON m.system_id = s.id LEFT JOIN file f ON "
+					   "f.media_id = m.id LEFT JOIN checksum c ON c.file_id = f.id ORDER BY s.id, m.id, f.id, c.name "
+					   "DESC");
+		for (const auto& row : qry)
+		{
+			if (systems.empty() || row.get<long long>(0) != systemId)
+			{
+				systemId = row.get<long long>(0);
+				VerifySystem system;
+				system.code = row.get<std::string>(1);
+				system.name = row.get<std::string>(2);
+				system.firstFile = files.size();
+				systems.push_back(std::move(system));
+			}
+			if (row.column_type(3) != SQLITE_NULL && (files.empty() || row.get<long long>(3) != fileId))
+			{
+				fileId = row.get<long long>(3);
+				VerifyFile file;
+				file.id = fileId;
+				file.name = row.get<std::string>(4);
+				file.hasData = row.get<int>(5) != 0;
+				file.size = row.get<long long>(6);
+				if (row.column_type(7) != SQLITE_NULL)
+				{
+					file.checksumName = row.get<std::string>(7);
+					file.checksumHash = row.get<std::string>(8);
+				}
+				files.push_back(std::move(file));
+			}
+			systems.back().lastFile = files.size();
+		}
+	}
+	long long manifestTables = 0;
+	if (content &&
+		getLong("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'manifest'", manifestTables) &&
+		manifestTables)
+	{
+		std::unordered_map<long long, std::string> contentHashes;
+		query qry(*db, "SELECT file_id, LOWER(hash) FROM manifest");
+		for (const auto& row : qry)
+			contentHashes.emplace(row.get<long long>(0), row.get<std::string>(1));
+		for (auto& file : files)
+		{
+			auto it = contentHashes.find(file.id);
+			if (it != contentHashes.end())
+				file.contentHash = std::move(it->second);
+		}
+	}
 
-		query qry(*db, "SELECT id FROM media WHERE system_id = :system_id");
-		qry.bind(":system_id", systemId);
-		for (const auto& media : qry)
+	// blobs are read and hashed on worker threads, results are counted in order on this thread
+	struct VerifyResult
+	{
+		bool hasChecksum = false;
+		bool good = true;
+		// reconstructed, but without a content hash to check it against
+		bool unverified = false;
+		size_t bytes = 0;
+	};
+	auto process = [&](size_t idx) {
+		const auto& file = files[idx];
+		VerifyResult result;
+		if (!file.checksumName.empty())
 		{
-			query qry2(*db, "SELECT id, name, data, LENGTH(data) FROM file WHERE media_id = :media_id");
-			qry2.bind(":media_id", media.get<long long>(0));
-			for (const auto& file : qry2)
+			result.hasChecksum = true;
+			try
 			{
-				bool hasChecksum = false;
-				query qry3(
-					*db, "SELECT LOWER(name), LOWER(data) FROM checksum WHERE file_id = :file_id ORDER BY name DESC");
-				qry3.bind(":file_id", file.get<long long>(0));
-				for (const auto& checksum : qry3)
+				std::vector<char> bytes;
+				if (file.hasData)
 				{
-					hasChecksum = true;
-					auto checksumName = checksum.get<std::string>(0);
-					auto checksumHash = checksum.get<std::string>(1);
-					auto fileData = file.get<void const*>(2);
-					auto fileDataSize = file.get<long long>(3);
-					auto filehash = file::hash::compute((const char*)fileData, (size_t)fileDataSize, checksumName);
-					if (checksumHash == filehash)
-						filesGood++;
-					else
-					{
-						filesBad++;
-						std::cout << "bad         : " << file.get<std::string>(1) << std::endl;
-					}
-					break;
+					BlobReader blobReader(*db, "file", "data");
+					bytes = blobReader.read(file.id);
 				}
-				if (!hasChecksum)
-					filesNoChecksum++;
+				result.good = file.checksumHash == file::hash::compute(bytes, file.checksumName);
+				result.bytes += bytes.size();
+			}
+			catch (const std::exception&)
+			{
+				result.good = false;
+			}
+		}
+		// the checksum is of the stored blob, so the reconstructed file is checked against its original size (the size
+		// of its normalized content), and is restored if it was normalized and checked against the sha1 of its source
+		// file. files imported without a manifest can't be checked and are reported as unverified
+		if (content && file.hasData && file.size > 0)
+		{
+			try
+			{
+				auto bytes = getNormalizedFile(file.id);
+				result.good = result.good && (long long)bytes.size() == file.size;
+				file::Transform transform;
+				if (getTransform(file.id, transform))
+					result.good = result.good && file::denormalize(bytes, transform);
+				if (!file.contentHash.empty())
+				{
+					result.hasChecksum = true;
+					result.good = result.good && file.contentHash == file::hash::sha1(bytes.data(), bytes.size());
+				}
+				else
+					result.unverified = true;
+				result.bytes += bytes.size();
+			}
+			catch (const std::exception&)
+			{
+				result.good = false;
 			}
 		}
+		return result;
+	};
+
+	long long totalBad = 0;
+	auto start = std::chrono::steady_clock::now();
+	auto lastProgress = start;
+	size_t totalBytes = 0;
+	for (const auto& system : systems)
+	{
+		long long filesGood = 0;
+		long long filesBad = 0;
+		long long filesNoChecksum = 0;
+		long long filesUnverified = 0;
+		size_t systemBytes = 0;
+		auto systemStart = std::chrono::steady_clock::now();
+
+		std::cout << system.code << " - " << system.name << std::endl;
+
+		auto count = system.lastFile - system.firstFile;
+		pipeline::ordered(count, jobs, jobs * 2, [&](size_t idx) { return process(system.firstFile + idx); },
+			[&](size_t idx, const VerifyResult& result) {
+				const auto& file = files[system.firstFile + idx];
+				if (!result.hasChecksum)
+					filesNoChecksum++;
+				if (!result.good)
+				{
+					filesBad++;
+					std::cout << "bad         : " << file.name << std::endl;
+				}
+				else if (result.unverified)
+					filesUnverified++;
+				else if (result.hasChecksum)
+					filesGood++;
+				systemBytes += result.bytes;
+
+				auto now = std::chrono::steady_clock::now();
+				if (now - lastProgress >= std::chrono::seconds(5))
+				{
+					lastProgress = now;
+					std::cout << "progress    : " << idx + 1 << "/" << count << " files" << std::endl;
+				}
+			});
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - systemStart).count();
 		std::cout << "total good  : " << filesGood << std::endl;
 		std::cout << "total bad   : " << filesBad << std::endl;
-		std::cout << "no checksum : " << filesNoChecksum << std::endl << std::endl;
+		std::cout << "no checksum : " << filesNoChecksum << std::endl;
+		if (content)
+			std::cout << "unverified  : " << filesUnverified << std::endl;
+		std::cout << "throughput  : " << (seconds > 0 ? systemBytes / seconds / (1024 * 1024) : 0) << " MB/s"
+				  << std::endl
+				  << std::endl;
+		totalBad += filesBad;
+		totalBytes += systemBytes;
+	}
+
+	// chunks are checked against the sha1 of their content, the checksums of chunked files only cover their chunk list
+	struct VerifyChunk
+	{
+		long long id = 0;
+		std::string hash;
+		long long size = 0;
+		std::string compression;
+	};
+	std::vector<VerifyChunk> chunks;
+	long long hasChunkTable = 0;
+	if (getLong("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'chunk'", hasChunkTable) &&
+		hasChunkTable)
+	{
+		query qry(*db, "SELECT id, hash, size, IFNULL(compression, '') FROM chunk ORDER BY id");
+		for (const auto& row : qry)
+		{
+			chunks.push_back({ row.get<long long>(0), row.get<std::string>(1), row.get<long long>(2),
+				row.get<std::string>(3) });
+		}
+	}
+	if (!chunks.empty())
+	{
+		long long chunksGood = 0;
+		long long chunksBad = 0;
+		size_t chunkBytes = 0;
+		auto chunksStart = std::chrono::steady_clock::now();
+
+		std::cout << "chunks" << std::endl;
+
+		pipeline::ordered(
+			chunks.size(), jobs, jobs * 2,
+			[&](size_t idx) {
+				const auto& chunk = chunks[idx];
+				VerifyResult result;
+				result.hasChecksum = true;
+				try
+				{
+					BlobReader blobReader(*db, "chunk", "data");
+					auto bytes = blobReader.read(chunk.id);
+					file::uncompress(bytes, (size_t)chunk.size, chunk.compression);
+					result.good = (long long)bytes.size() == chunk.size &&
+								  chunk.hash == file::hash::sha1(bytes.data(), bytes.size());
+					result.bytes = bytes.size();
+				}
+				catch (const std::exception&)
+				{
+					result.good = false;
+				}
+				return result;
+			},
+			[&](size_t idx, const VerifyResult& result) {
+				if (!result.good)
+				{
+					chunksBad++;
+					std::cout << "bad         : chunk " << chunks[idx].id << std::endl;
+				}
+				else
+					chunksGood++;
+				chunkBytes += result.bytes;
+			});
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - chunksStart).count();
+		std::cout << "total good  : " << chunksGood << std::endl;
+		std::cout << "total bad   : " << chunksBad << std::endl;
+		std::cout << "throughput  : " << (seconds > 0 ? chunkBytes / seconds / (1024 * 1024) : 0) << " MB/s"
+				  << std::endl
+				  << std::endl;
+		totalBad += chunksBad;
+		totalBytes += chunkBytes;
 	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "verified    : " << totalBytes / (1024 * 1024) << " MB in " << seconds << " s" << std::endl;
+	return totalBad == 0;
+}
+
+bool Romdb::optimize(size_t maxDepth, size_t decodeBudget)
+{
+	if (!db)
+		return false;
+
+	// systems don't store their patch profile, only the profile set for the command is used
+	file::PatchProfile encoderProfile;
+	if (!file::parsePatchProfile(patchProfile, encoderProfile))
+		return false;
+
+	PatchGraph graph(*db);
+	auto breaksLimits = [&](size_t depth, long long decodeSize) {
+		return (maxDepth && depth > maxDepth) || (decodeBudget && decodeSize > (long long)decodeBudget);
+	};
+	graph.walkLevels([](std::vector<long long>&) {});
+	auto before = graph.measure();
+
+	// a patch that breaks a limit is encoded against its nearest and its farthest ancestors that keep it within the
+	// limits and stored whole (as a keyframe), and the smallest is kept
+	struct Reencoded
+	{
+		std::vector<char> bytes;
+		std::string compression;
+		long long parentId = 0;
+	};
+	StatementCache stmts(*db);
+	BulkTransaction tx(*db, commitInterval);
+	long long reparentedCount = 0;
+	long long keyframeCount = 0;
+	long long overLimitCount = 0;
+	graph.walkLevels([&](std::vector<long long>& level) {
+		std::vector<long long> breaking;
+		for (auto id : level)
+		{
+			const auto& file = graph.at(id);
+			if (PatchGraph::isPatch(file) && breaksLimits(file.depth, file.decodeSize))
+				breaking.push_back(id);
+		}
+
+		pipeline::ordered(
+			breaking.size(), jobs, jobs * 2,
+			[&](size_t idx) {
+				auto id = breaking[idx];
+				const auto& file = graph.at(id);
+
+				// ancestors the file can be patched from without breaking the limits, from the nearest
+				std::vector<long long> ancestors;
+				auto compression = patchBlobCompression(file.compression);
+				for (auto ancestorId = file.parentId; ancestorId;)
+				{
+					const auto& ancestor = graph.at(ancestorId);
+					if (!breaksLimits(ancestor.depth + 1, ancestor.decodeSize + file.size))
+						ancestors.push_back(ancestorId);
+					if (compression.empty())
+						compression = patchBlobCompression(ancestor.compression);
+					ancestorId = ancestor.parentId;
+				}
+				compression = blobCompression(compression);
+				if (ancestors.size() > 2)
+					ancestors.erase(ancestors.begin() + 1, ancestors.end() - 1);
+
+				auto bytes = getNormalizedFile(id);
+				Reencoded best;
+				best.bytes = bytes;
+				best.compression = file::compress(best.bytes, compression) ? compression : std::string();
+				for (auto ancestorId : ancestors)
+				{
+					Reencoded patch;
+					file::PatchGroupEncoder encoder(getNormalizedFile(ancestorId), encoderProfile);
+					if (!encoder.createPatch(bytes.data(), bytes.size(), patch.bytes))
+						continue;
+					patch.compression = file::compress(patch.bytes, compression) ? compression : std::string();
+					patch.parentId = ancestorId;
+					if (patch.bytes.size() < best.bytes.size())
+						best = std::move(patch);
+				}
+				return best;
+			},
+			[&](size_t idx, const Reencoded& reencoded) {
+				auto id = breaking[idx];
+				replaceFileData(stmts, id, reencoded.bytes, reencoded.compression, reencoded.parentId);
+				tx.step();
+
+				auto& file = graph.at(id);
+				file.parentId = reencoded.parentId;
+				file.hasData = true;
+				file.dataSize = (long long)reencoded.bytes.size();
+				file.compression = reencoded.compression;
+				graph.updateCost(file);
+				if (reencoded.parentId)
+					reparentedCount++;
+				else
+					keyframeCount++;
+				if (breaksLimits(file.depth, file.decodeSize))
+					overLimitCount++;
+			});
+		tx.checkpoint();
+	});
+	tx.commit();
+
+	auto after = graph.measure();
+	std::cout << "re-parented : " << reparentedCount << " files" << std::endl;
+	std::cout << "keyframes   : " << keyframeCount << " files" << std::endl;
+	if (overLimitCount)
+		std::cout << "over limits : " << overLimitCount << " files bigger than the decode budget" << std::endl;
+	std::cout << "stored      : " << before.dataSize / 1024 << " KB -> " << after.dataSize / 1024 << " KB" << std::endl;
+	std::cout << "max depth   : " << before.maxDepth << " -> " << after.maxDepth << " patches" << std::endl;
+	std::cout << "max decode  : " << before.maxDecodeSize / 1024 << " KB -> " << after.maxDecodeSize / 1024 << " KB"
+			  << std::endl;
+	return true;
 }
 
+bool Romdb::flatten(size_t maxDepth)
+{
+	if (!db)
+		return false;
+
+	maxDepth = std::max(maxDepth, (size_t)1);
+	PatchGraph graph(*db);
+	graph.walkLevels([](std::vector<long long>&) {});
+	auto before = graph.measure();
+
+	// a patch deeper than maxDepth is merged with the patch of its parent, which is at most maxDepth deep once the
+	// level above is flattened, so it becomes a patch of its grandparent. the merged patch is encoded from the
+	// instructions of both patches, the files aren't decoded
+	struct Merged
+	{
+		std::vector<char> bytes;
+		std::string compression;
+		long long parentId = 0;
+	};
+	StatementCache stmts(*db);
+	BulkTransaction tx(*db, commitInterval);
+	long long mergedCount = 0;
+	long long unmergedCount = 0;
+	graph.walkLevels([&](std::vector<long long>& level) {
+		std::vector<long long> deep;
+		for (auto id : level)
+		{
+			const auto& file = graph.at(id);
+			if (PatchGraph::isPatch(file) && file.depth > maxDepth)
+				deep.push_back(id);
+		}
+
+		pipeline::ordered(
+			deep.size(), jobs, jobs * 2,
+			[&](size_t idx) {
+				auto id = deep[idx];
+				const auto& file = graph.at(id);
+
+				// aliases have the content of their parent, so the parent patch is the first patch above them
+				auto parentId = file.parentId;
+				while (!PatchGraph::isPatch(graph.at(parentId)) && graph.at(parentId).hasData &&
+					   graph.at(parentId).parentId)
+					parentId = graph.at(parentId).parentId;
+				const auto& parent = graph.at(parentId);
+				Merged merged;
+				if (!PatchGraph::isPatch(parent) || patchEngine(parent.compression).id() != vcdiffEngine ||
+					patchEngine(file.compression).id() != vcdiffEngine)
+					return merged;
+
+				BlobReader blobReader(*db, "file", "data");
+				auto parentPatch = blobReader.read(parentId);
+				file::uncompress(parentPatch, parent.size, parent.compression);
+				auto patch = blobReader.read(id);
+				file::uncompress(patch, file.size, file.compression);
+				if (!file::mergePatches(
+						parentPatch.data(), parentPatch.size(), patch.data(), patch.size(), merged.bytes))
+					return merged;
+
+				auto compression = !file.compression.empty() ? file.compression : parent.compression;
+				merged.compression = file::compress(merged.bytes, compression) ? compression : std::string();
+				merged.parentId = parent.parentId;
+				return merged;
+			},
+			[&](size_t idx, const Merged& merged) {
+				if (merged.bytes.empty())
+				{
+					unmergedCount++;
+					return;
+				}
+				auto id = deep[idx];
+				replaceFileData(stmts, id, merged.bytes, merged.compression, merged.parentId);
+				tx.step();
+
+				auto& file = graph.at(id);
+				file.parentId = merged.parentId;
+				file.dataSize = (long long)merged.bytes.size();
+				file.compression = merged.compression;
+				graph.updateCost(file);
+				mergedCount++;
+			});
+		tx.checkpoint();
+	});
+	tx.commit();
+
+	auto after = graph.measure();
+	std::cout << "merged      : " << mergedCount << " patches" << std::endl;
+	if (unmergedCount)
+		std::cout << "not merged  : " << unmergedCount
+				  << " patches of archive files, of another delta engine than vcdiff or invalid" << std::endl;
+	std::cout << "stored      : " << before.dataSize / 1024 << " KB -> " << after.dataSize / 1024 << " KB" << std::endl;
+	std::cout << "max depth   : " << before.maxDepth << " -> " << after.maxDepth << " patches" << std::endl;
+	std::cout << "max decode  : " << before.maxDecodeSize / 1024 << " KB -> " << after.maxDecodeSize / 1024 << " KB"
+			  << std::endl;
+	return true;
+}
 
 bool Romdb::createPatchFile(
 	const std::string& importPath_, const std::string& patchFilePath_, const std::string& configName)
@@ -995,15 +3298,9 @@ bool Romdb::createSystemPatchFile(
 	}
 
 	// group files to media
-	std::set<std::vector<std::string>> mediaFilesSet;
-	for (const auto& media : utils::reverse(mediaLines))
-	{
-		if (media.empty())
-			continue;
-
-		auto filteredFiles = utils::filterStrings(fileLinesSet, media);
-		mediaFilesSet.insert(filteredFiles);
-	}
+	mediaLines.erase(std::remove(mediaLines.begin(), mediaLines.end(), std::string()), mediaLines.end());
+	auto mediaFiles = utils::groupByPrefix(fileLinesSet, mediaLines);
+	std::set<std::vector<std::string>> mediaFilesSet(mediaFiles.begin(), mediaFiles.end());
 
 	// create patch.txt
 	std::string patchText;
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "file.h"
+#include "filecache.h"
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include <sqlite3pp.h>
 
@@ -9,16 +12,62 @@ class Romdb
 private:
 	std::optional<sqlite3pp::database> db;
 
+	// number of rows to write before committing an import transaction (0 = commit once per system)
+	long long commitInterval = 0;
+
+	// skip the media and patch groups already committed by an import that didn't finish
+	bool resume = false;
+
+	// number of worker threads used to read, compress and hash files
+	size_t jobs = 1;
+
+	// VCDIFF source window size in bytes (0 = default)
+	size_t patchWindowSize = 0;
+
+	// patch imported files from the most similar stored file
+	bool autoPatch = false;
+
+	// xdelta3 encoder profile used instead of the profile of system.txt (empty = profile of system.txt)
+	std::string patchProfile;
+
+	// delta engine of imported patches (see DeltaEngine), or best to keep the smallest patch of every engine
+	// (empty = vcdiff)
+	std::string deltaEngine;
+
+	// normalize imported ROM dumps (see file::normalize), so the dumps of a ROM patch to almost nothing
+	bool normalize = false;
+
+	// the database has a transform table (databases opened without being imported to since it was added don't)
+	bool hasTransforms = false;
+
+	// maximum number of files in a patch chain, longer chains are reported as invalid
+	static constexpr size_t maxChainDepth = 1000;
+
+	// reconstructed files, so files patched from the same parent only reconstruct the parent once
+	FileCache fileCache{ 64 * 1024 * 1024 };
+
 	// get long long from query that returns a single line/value
 	bool getLong(const std::string_view sql, long long& val);
 
 	// check if the database is a valid romdb database
 	bool isValid();
 
+	// get the transform of a normalized file, returns false if the file isn't normalized
+	bool getTransform(long long fileId, file::Transform& transform);
+
+	// get or reconstruct the normalized content of a file, which its patches and stored blob are made of
+	std::vector<char> getNormalizedFile(long long fileId);
+
+	// imports a system, a phase per member function
+	class SystemImporter;
+
 	// import a system
 	bool importSystem(
 		const std::filesystem::path& romsPath, const std::filesystem::path& importPath, const std::string& configName);
 
+	// dump the files of a system, one patch family per task, and list their names in fileText
+	void dumpSystemFiles(long long systemId, const std::filesystem::path& filesPath, std::string& fileText);
+
 	// creates a patch.txt list from the import folder
 	static bool createSystemPatchFile(
 		const std::filesystem::path& importPath, const std::string& patchFilePath, const std::string& configName);
@@ -33,20 +82,69 @@ public:
 	// check if the database is empty and create the schema if it is
 	bool createSchema(const std::string& schemaPath);
 
+	// set the number of rows to write before committing an import transaction (0 = commit once per system)
+	void setCommitInterval(long long rows) { commitInterval = rows; }
+
+	// skip the media and patch groups already committed by an import that didn't finish
+	void setResume(bool resume_) { resume = resume_; }
+
+	// set the number of worker threads (0 = number of cores)
+	void setJobs(size_t jobs_);
+
+	// set the VCDIFF source window size in bytes, which bounds the memory used to patch big files (0 = default)
+	void setPatchWindowSize(size_t bytes) { patchWindowSize = bytes; }
+
+	// patch imported files that aren't in patch.txt from the most similar stored file (of any system)
+	void setAutoPatch(bool autoPatch_) { autoPatch = autoPatch_; }
+
+	// set the xdelta3 encoder profile of patches (see file::parsePatchProfile), which overrides the profile of
+	// system.txt
+	void setPatchProfile(const std::string& profile) { patchProfile = profile; }
+
+	// set the delta engine of imported patches: vcdiff, bank or best, which creates a patch with every engine and
+	// keeps the smallest
+	void setDeltaEngine(const std::string& engine) { deltaEngine = engine; }
+
+	// normalize the byte order of imported N64 dumps and remove the copier headers of imported ROMs. normalized files
+	// are restored when they're read
+	void setNormalize(bool normalize_) { normalize = normalize_; }
+
 	// import systems
 	bool import(const std::string& importPath, const std::string& configName);
 
 	// import systems
 	bool import(const std::string& romsPath, const std::string& importPath, const std::string& configName);
 
-	// get or reconstruct file
+	// get or reconstruct file, restored if it was normalized
 	std::vector<char> getFile(long long fileId);
 
+	// open a file as a stream. standalone files are read from their blob and uncompressed as they are read,
+	// so reading only the start of a file (e.g. a header) doesn't read or uncompress the rest of it.
+	// patched files are reconstructed first. returns nullptr if the file doesn't exist
+	std::unique_ptr<file::Reader> openFile(long long fileId);
+
+	// set the maximum size in bytes of the reconstructed files cache (0 = disabled)
+	void setFileCacheSize(size_t bytes) { fileCache.setMaxSize(bytes); }
+
+	// reconstructed files cache
+	const FileCache& getFileCache() const { return fileCache; }
+
 	// dump a database
 	bool dump(const std::string& dumpPath, bool fullDump);
 
-	// verify a database
-	void verify();
+	// verify the checksums of a database, and that every file can be reconstructed to its size if content is set.
+	// returns false if any file is bad
+	bool verify(bool content);
+
+	// re-encode the patches that break a limit so reading any file decodes at most maxDepth patches and the files
+	// of its chain are at most decodeBudget bytes (0 = no limit). a patch is patched again from an ancestor within
+	// the limits or stored whole, whichever is smaller
+	bool optimize(size_t maxDepth, size_t decodeBudget);
+
+	// merge the patches deeper than maxDepth (at least 1) with the patch of their parent, until every file decodes
+	// at most maxDepth patches. the VCDIFF patches are merged without decoding the files, so it's faster than
+	// optimize, but the merged patches aren't smaller than the patches they're made of
+	bool flatten(size_t maxDepth);
 
 	// creates a patch.txt list from the import folder
 	static bool createPatchFile(
@@ -69,3 +69,41 @@ CREATE TABLE filetag(
 
 CREATE INDEX filetag_tag_id_idx ON filetag(tag_id);
 CREATE INDEX filetag_file_id_idx ON filetag(file_id);
+
+CREATE TABLE manifest(
+  file_id INTEGER NOT NULL UNIQUE,
+  path TEXT NOT NULL,
+  size INTEGER NOT NULL,
+  mtime INTEGER NOT NULL,
+  hash TEXT NOT NULL,
+  FOREIGN KEY(file_id) REFERENCES file(id)
+);
+
+CREATE TABLE journal(
+  system_id INTEGER NOT NULL,
+  kind TEXT NOT NULL,
+  unit_id INTEGER NOT NULL,
+  FOREIGN KEY(system_id) REFERENCES system(id),
+  UNIQUE(system_id, kind, unit_id)
+);
+
+CREATE TABLE chunk(
+  id INTEGER PRIMARY KEY,
+  hash TEXT NOT NULL UNIQUE,
+  size INTEGER NOT NULL,
+  compression TEXT,
+  data BLOB NOT NULL
+);
+
+CREATE TABLE sketch(
+  file_id INTEGER NOT NULL UNIQUE,
+  data BLOB NOT NULL,
+  FOREIGN KEY(file_id) REFERENCES file(id)
+);
+
+CREATE TABLE transform(
+  file_id INTEGER NOT NULL UNIQUE,
+  name TEXT NOT NULL,
+  data BLOB,
+  FOREIGN KEY(file_id) REFERENCES file(id)
+);
@@ -84,22 +84,54 @@ namespace utils
 		return str;
 	}
 
-	std::vector<std::string> filterStrings(stringSetNoCase& strings, std::string startsWith_)
+	void PrefixTrie::add(const std::string_view prefix, size_t value)
 	{
-		std::vector<std::string> filtered;
-		for (auto it = strings.begin(); it != strings.end();)
+		size_t node = 0;
+		for (auto c : prefix)
 		{
-			if (startsWith(*it, startsWith_))
+			auto it = nodes[node].children.find(c);
+			if (it == nodes[node].children.end())
 			{
-				filtered.push_back(*it);
-				strings.erase(it++);
-			}
-			else
-			{
-				++it;
+				nodes.emplace_back();
+				it = nodes[node].children.emplace(c, nodes.size() - 1).first;
 			}
+			node = it->second;
+		}
+		if (nodes[node].value == npos)
+			nodes[node].value = value;
+	}
+
+	size_t PrefixTrie::findLongest(const std::string_view str) const
+	{
+		size_t node = 0;
+		auto value = nodes[node].value;
+		for (auto c : str)
+		{
+			auto it = nodes[node].children.find(c);
+			if (it == nodes[node].children.end())
+				break;
+			node = it->second;
+			if (nodes[node].value != npos)
+				value = nodes[node].value;
+		}
+		return value;
+	}
+
+	std::vector<std::vector<std::string>> groupByPrefix(
+		const stringSetNoCase& strings, const std::vector<std::string>& prefixes)
+	{
+		PrefixTrie trie;
+		for (size_t i = 0; i < prefixes.size(); i++)
+			trie.add(prefixes[i], i);
+
+		std::vector<std::vector<std::string>> groups(prefixes.size());
+		for (const auto& str : strings)
+		{
+			auto idx = trie.findLongest(str);
+			if (idx != PrefixTrie::npos)
+				groups[idx].push_back(str);
 		}
-		return filtered;
+		return groups;
 	}
 
 	std::wstring str2wstr(const std::string& str)
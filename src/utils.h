@@ -37,7 +37,31 @@ namespace utils
 	template <class T> using stringMapNoCase = std::map<std::string, T, compareCaseInsensitive>;
 	using stringSetNoCase = std::set<std::string, compareCaseInsensitive>;
 
-	std::vector<std::string> filterStrings(stringSetNoCase& strings, std::string startsWith_);
+	// finds the longest of a set of prefixes that a string starts with, comparing bytes like startsWith
+	class PrefixTrie
+	{
+	private:
+		struct Node
+		{
+			std::map<char, size_t> children;
+			size_t value = npos;
+		};
+		std::vector<Node> nodes{ 1 };
+
+	public:
+		static constexpr size_t npos = (size_t)-1;
+
+		// add a prefix, a prefix added twice keeps its first value
+		void add(const std::string_view prefix, size_t value);
+
+		// value of the longest prefix str starts with, or npos
+		size_t findLongest(const std::string_view str) const;
+	};
+
+	// groups strings by the longest prefix they start with. returns one group per prefix, in the order of strings.
+	// strings without a prefix aren't in any group
+	std::vector<std::vector<std::string>> groupByPrefix(
+		const stringSetNoCase& strings, const std::vector<std::string>& prefixes);
 
 	// converts UTF-8 string to UTF-16 wstring
 	std::wstring str2wstr(const std::string& str);
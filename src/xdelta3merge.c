@@ -0,0 +1,226 @@
+// xdelta3 and the VCDIFF merge of its command line tool (xdelta3 -m), which isn't part of the library.
+// the merge code uses the static functions of xdelta3.c, so both are built in this translation unit
+#include "xdelta3.c"
+
+// the merge code prints its errors with the printf of the command line tool, they are returned instead
+#define XD3_LIB_ERRMSG(stream, ret) "%s\n", xd3_errstring(stream)
+
+void xprintf(const char* fmt, ...)
+{
+	(void)fmt;
+}
+
+#include "xdelta3-merge.h"
+#include "xdelta3merge.h"
+
+// decodes the instructions of a patch into the whole target state of stream. the source isn't read
+static int readPatch(xd3_stream* stream, const uint8_t* patch, size_t patchSize)
+{
+	xd3_config config;
+	int ret;
+
+	xd3_init_config(&config, XD3_ADLER32_NOVER | XD3_SKIP_EMIT);
+	if ((ret = xd3_config_stream(stream, &config)) || (ret = xd3_whole_state_init(stream)))
+		return ret;
+
+	stream->flags |= XD3_FLUSH;
+	xd3_avail_input(stream, patch, (usize_t)patchSize);
+	while (1)
+	{
+		switch ((ret = xd3_decode_input(stream)))
+		{
+		case XD3_INPUT:
+			return 0;
+		case XD3_OUTPUT:
+			if ((ret = xd3_whole_append_window(stream)))
+				return ret;
+			xd3_consume_output(stream);
+			break;
+		case XD3_GOTHEADER:
+		case XD3_WINSTART:
+		case XD3_WINFINISH:
+			break;
+		default:
+			return ret;
+		}
+	}
+}
+
+// encodes the whole target state of stream with the windows of the patch it was decoded from, so target copies
+// stay within their window (main_merge_output of the command line tool)
+static int writePatch(xd3_stream* stream, xd3MergeOutput output, void* context)
+{
+	xd3_whole_state* target = &stream->whole_target;
+	xd3_stream encoder;
+	xd3_config config;
+	xd3_source source;
+	uint8_t* window = NULL;
+	usize_t windowAlloc = 0;
+	usize_t windowNum = 0;
+	usize_t instPos = 0;
+	xoff_t outputPos = 0;
+	int atLeastOnce = 0;
+	int ret;
+
+	memset(&encoder, 0, sizeof(encoder));
+	memset(&source, 0, sizeof(source));
+	xd3_init_config(&config, 0);
+	if ((ret = xd3_config_stream(&encoder, &config)) || (ret = xd3_encode_init_partial(&encoder)))
+		goto done;
+
+	// skip the input buffering of the encoder, each window is given whole
+	encoder.enc_state = ENC_INPUT;
+	encoder.flags |= XD3_FLUSH;
+
+	// at least one window is encoded, for empty targets
+	while (instPos < target->instlen || !atLeastOnce)
+	{
+		xoff_t windowStart = outputPos;
+		int windowSrcSet = 0;
+		xoff_t windowSrcMin = 0;
+		xoff_t windowSrcMax = 0;
+		usize_t windowPos = 0;
+		usize_t windowSize;
+
+		atLeastOnce = 1;
+		if (windowNum >= target->wininfolen || target->wininfo[windowNum].offset != outputPos)
+		{
+			ret = XD3_INTERNAL;
+			goto done;
+		}
+		windowSize = target->wininfo[windowNum++].length;
+		if (!window || windowAlloc < windowSize)
+		{
+			free(window);
+			windowAlloc = windowSize ? windowSize : 1;
+			if (!(window = (uint8_t*)malloc(windowAlloc)))
+			{
+				ret = ENOMEM;
+				goto done;
+			}
+		}
+
+		// the encoder waits for input until next_in is set
+		encoder.next_in = window;
+		if (xd3_encode_input(&encoder) != XD3_WINSTART)
+		{
+			ret = XD3_INTERNAL;
+			goto done;
+		}
+
+		while (windowPos < windowSize && instPos < target->instlen)
+		{
+			xd3_winst* inst = &target->inst[instPos];
+			usize_t take = xd3_min(inst->size, windowSize - windowPos);
+			xoff_t addr;
+
+			switch (inst->type)
+			{
+			case XD3_RUN:
+				if ((ret = xd3_emit_run(&encoder, windowPos, take, &target->adds[inst->addr])))
+					goto done;
+				break;
+			case XD3_ADD:
+				// adds are implicit, they are the input bytes not covered by another instruction
+				memcpy(window + windowPos, target->adds + inst->addr, take);
+				break;
+			default:
+				if (inst->mode != 0)
+				{
+					windowSrcMin = windowSrcSet ? xd3_min(windowSrcMin, inst->addr) : inst->addr;
+					windowSrcMax = windowSrcSet ? xd3_max(windowSrcMax, inst->addr + take) : inst->addr + take;
+					windowSrcSet = 1;
+					addr = inst->addr;
+				}
+				else
+				{
+					addr = inst->addr - windowStart;
+				}
+				if ((ret = xd3_found_match(&encoder, windowPos, take, addr, inst->mode != 0)))
+					goto done;
+				break;
+			}
+
+			windowPos += take;
+			outputPos += take;
+			if (take == inst->size)
+			{
+				instPos++;
+			}
+			else
+			{
+				// the rest of the instruction starts the next window
+				if (inst->type != XD3_RUN)
+					inst->addr += take;
+				inst->size -= take;
+			}
+		}
+
+		// the windows of the target are the windows of the second patch, so their checksums are still valid
+		if (stream->dec_win_ind & VCD_ADLER32)
+		{
+			encoder.flags |= XD3_ADLER32_RECODE;
+			encoder.recode_adler32 = target->wininfo[windowNum - 1].adler32;
+		}
+
+		xd3_avail_input(&encoder, window, windowPos);
+		encoder.enc_state = ENC_INSTR;
+		if (windowSrcSet)
+		{
+			encoder.srcwin_decided = 1;
+			encoder.src = &source;
+			source.srclen = (usize_t)(windowSrcMax - windowSrcMin);
+			source.srcbase = windowSrcMin;
+			encoder.taroff = source.srclen;
+		}
+		else
+		{
+			encoder.srcwin_decided = 0;
+			encoder.src = NULL;
+			encoder.taroff = 0;
+		}
+
+		while ((ret = xd3_encode_input(&encoder)) != XD3_INPUT)
+		{
+			if (ret == XD3_OUTPUT)
+			{
+				if (output(context, encoder.next_out, encoder.avail_out))
+				{
+					ret = XD3_INTERNAL;
+					goto done;
+				}
+				xd3_consume_output(&encoder);
+			}
+			else if (ret != XD3_GOTHEADER && ret != XD3_WINSTART && ret != XD3_WINFINISH)
+			{
+				ret = ret ? ret : XD3_INTERNAL;
+				goto done;
+			}
+		}
+	}
+	ret = 0;
+
+done:
+	free(window);
+	xd3_free_stream(&encoder);
+	return ret;
+}
+
+int xd3MergePatches(const uint8_t* patch1, size_t patch1Size, const uint8_t* patch2, size_t patch2Size,
+	xd3MergeOutput output, void* context)
+{
+	xd3_stream stream1;
+	xd3_stream stream2;
+	int ret;
+
+	memset(&stream1, 0, sizeof(stream1));
+	memset(&stream2, 0, sizeof(stream2));
+	if (!(ret = readPatch(&stream1, patch1, patch1Size)) && !(ret = readPatch(&stream2, patch2, patch2Size)) &&
+		!(ret = xd3_merge_input_output(&stream2, &stream1.whole_target)))
+	{
+		ret = writePatch(&stream2, output, context);
+	}
+	xd3_free_stream(&stream1);
+	xd3_free_stream(&stream2);
+	return ret;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// receives the bytes of a merged patch in chunks, returns 0 to continue
+typedef int (*xd3MergeOutput)(void* context, const uint8_t* data, size_t size);
+
+// merges a VCDIFF patch of A to B and a VCDIFF patch of B to C into a patch of A to C, without A, B or C.
+// returns 0 or an xdelta3 error code
+int xd3MergePatches(const uint8_t* patch1, size_t patch1Size, const uint8_t* patch2, size_t patch2Size,
+	xd3MergeOutput output, void* context);
+
+#ifdef __cplusplus
+}
+#endif